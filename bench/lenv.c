@@ -0,0 +1,82 @@
+/** 
+ * Symbol lookup as the environment grows. Binds `n` symbols, then looks them up in turn. With the hash
+ * table of symbol ids the time per lookup should stay flat from a thousand bindings to 100k, while the
+ * linear scan with `strcmp` that it replaced grows with the bindings
+ *
+ *   gcc -std=c11 -O2 -pthread bench/lenv.c mpc.c -lm -lreadline -o lenv && ./lenv
+ */
+#define main lispc_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_LOOKUPS 20000000
+#define BENCH_SCANS   20000
+
+/** 
+ * Where the results looked up go, so that the lookups can't be optimized away
+ */
+volatile long bench_sink;
+
+/** 
+ * Look up `s` the way `lenv_get` used to, comparing it with every name bound
+ */
+int bench_scan(char** names, int n, char* s) {
+    for (int i = 0; i < n; ++i) {
+        if (strcmp(names[i], s) == 0) { return i; }
+    }
+    return -1;
+}
+
+int main(void) {
+    lval_small_init();
+
+    printf("%10s %14s %14s\n", "bindings", "ns/lookup", "ns/scan");
+
+    for (int n = 1000; n <= 100000; n *= 10) {
+        lenv* e = lenv_new();
+        lval** keys = malloc(sizeof(lval*) * n);
+        char** names = malloc(sizeof(char*) * n);
+        char name[32];
+
+        for (int i = 0; i < n; ++i) {
+            snprintf(name, sizeof(name), "sym%d", i);
+            names[i] = malloc(strlen(name) + 1);
+            strcpy(names[i], name);
+            keys[i] = lval_sym(name);
+            lval* v = lval_num(i);
+            lenv_put(e, keys[i], v);
+            lval_del(v);
+        }
+
+        /* Look up the keys in a scattered order, so that caches can't hide a slow probe */
+        long sum = 0;
+        clock_t start = clock();
+        for (long k = 0, i = 0; k < BENCH_LOOKUPS; ++k, i = (i + 7919) % n) {
+            lval* v = lenv_get(e, keys[i]);
+            sum += v->num;
+            lval_del(v);
+        }
+        double lookup = (double)(clock() - start) / CLOCKS_PER_SEC / BENCH_LOOKUPS;
+
+        start = clock();
+        for (long k = 0, i = 0; k < BENCH_SCANS; ++k, i = (i + 7919) % n) {
+            sum += bench_scan(names, n, names[i]);
+        }
+        double scan = (double)(clock() - start) / CLOCKS_PER_SEC / BENCH_SCANS;
+
+        bench_sink = sum;
+        printf("%10d %14.2f %14.2f\n", n, lookup * 1e9, scan * 1e9);
+
+        for (int i = 0; i < n; ++i) {
+            lval_del(keys[i]);
+            free(names[i]);
+        }
+        free(keys);
+        free(names);
+        lenv_del(e);
+    }
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+/** 
+ * Memory per element of large q-expressions of numbers. Each layout is built in a process of its own and
+ * measured by how much its resident memory grows. The old layout, with all five payload fields side by
+ * side and every node from malloc, is rebuilt here for comparison. Linux only, as it reads /proc
+ *
+ *   gcc -std=c11 -O2 -pthread bench/lval.c mpc.c -lm -lreadline -o lval && ./lval
+ *   gcc -std=c11 -O2 -pthread -DLISPC_NO_POOL bench/lval.c mpc.c -lm -lreadline -o lval && ./lval
+ */
+#define main lispc_main
+#include "../variables.c"
+#undef main
+
+#include <sys/wait.h>
+
+#define BENCH_COUNT 10000000
+
+/** 
+ * The lval layout before the payloads were put in a union
+ */
+typedef struct bench_old_lval {
+    int type;
+    long num;
+    char* err;
+    char* sym;
+    lbuiltin fun;
+    int count;
+    struct bench_old_lval** cell;
+} bench_old_lval;
+
+/** 
+ * Resident memory of this process, in bytes
+ */
+long bench_resident(void) {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL || fscanf(f, "%ld %ld", &pages, &resident) != 2) { resident = 0; }
+    if (f) { fclose(f); }
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/** 
+ * Build a q-expression of BENCH_COUNT numbers in the layout `kind`, returning what it holds on to
+ */
+void* bench_build(int kind) {
+    /* The old layout, a node and a slot in the cell array per number, grown by realloc one by one */
+    if (kind == 0) {
+        bench_old_lval* v = calloc(1, sizeof(bench_old_lval));
+        for (int i = 0; i < BENCH_COUNT; ++i) {
+            bench_old_lval* x = calloc(1, sizeof(bench_old_lval));
+            x->num = LVAL_SMALL_MAX + 1 + i;
+            v->cell = realloc(v->cell, sizeof(bench_old_lval*) * ++v->count);
+            v->cell[v->count - 1] = x;
+        }
+        return v;
+    }
+
+    /* Numbers too big to be shared need a node each. Small ones are all shared, and packed lists need no
+       nodes at all. They're packed from small numbers, as nodes freed by packing would stay resident */
+    lval* v = lval_qexpr();
+    for (int i = 0; i < BENCH_COUNT; ++i) {
+        v = lval_add(v, lval_num(kind >= 2 ? i % LVAL_SMALL_MAX : LVAL_SMALL_MAX + 1 + i));
+    }
+    if (kind == 3) { lval_pack(v); }
+
+    return v;
+}
+
+int main(void) {
+    static const char* kinds[] = { "old layout", "big numbers", "small numbers", "packed" };
+
+    printf("sizeof(lval) is %zu bytes, and was %zu\n", sizeof(lval), sizeof(bench_old_lval));
+    printf("%16s %16s\n", "layout", "bytes/element");
+
+    for (int kind = 0; kind < 4; ++kind) {
+        fflush(stdout);
+        if (fork() == 0) {
+            lval_small_init();
+            long before = bench_resident();
+            void* v = bench_build(kind);
+            long after = bench_resident();
+
+            printf("%16s %16.1f\n", kinds[kind], (double)(after - before) / BENCH_COUNT);
+            if (v == NULL) { return 1; }
+            return 0;
+        }
+        wait(NULL);
+    }
+
+    return 0;
+}
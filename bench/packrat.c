@@ -0,0 +1,82 @@
+/*
+** Packrat depth scaling
+**
+** Parses nested input with a grammar that tries
+** every alternative of `s` on the same `p`, which
+** takes exponential time without packrat mode.
+** In packrat mode the time per level should stay
+** flat as the depth doubles.
+**
+**   gcc -std=c99 -O2 bench/packrat.c mpc.c -lm -o packrat && ./packrat
+*/
+
+#include "../mpc.h"
+
+#include <time.h>
+
+static char *nested(int depth) {
+  
+  char *s = malloc(depth * 2 + 2);
+  int i;
+  
+  for (i = 0; i < depth; i++) { s[i] = '('; }
+  s[depth] = 'c';
+  for (i = 0; i < depth; i++) { s[depth + 1 + i] = ')'; }
+  s[depth * 2 + 1] = '\0';
+  
+  return s;
+}
+
+int main(void) {
+  
+  mpc_parser_t *S = mpc_new("s");
+  mpc_parser_t *P = mpc_new("p");
+  mpc_parser_t *Top = mpc_new("top");
+  mpc_result_t a, b;
+  clock_t start;
+  double secs;
+  char *input;
+  int depth;
+  
+  mpc_err_t *err = mpca_lang(MPC_LANG_DEFAULT,
+    " s   : <p> 'a' | <p> 'b' | <p> ;        "
+    " p   : '(' <s> ')' | 'c' ;              "
+    " top : /^/ <s> /$/ ;                    ",
+    S, P, Top, NULL);
+  
+  if (err) { mpc_err_print(err); mpc_err_delete(err); return 1; }
+  
+  /* Packrat mode must give just what plain parsing does */
+  
+  input = nested(8);
+  if (!mpc_parse("<bench>", input, Top, &a)) { mpc_err_print(a.error); return 1; }
+  if (!mpc_parse_packrat("<bench>", input, Top, &b)) { mpc_err_print(b.error); return 1; }
+  if (!mpc_ast_eq(a.output, b.output)) { printf("packrat output differs\n"); return 1; }
+  mpc_ast_delete(a.output);
+  mpc_ast_delete(b.output);
+  free(input);
+  
+  printf("%8s %10s %12s\n", "depth", "ms", "us/level");
+  
+  for (depth = 250; depth <= 4000; depth *= 2) {
+    
+    input = nested(depth);
+    start = clock();
+    
+    if (!mpc_parse_packrat("<bench>", input, Top, &a)) {
+      mpc_err_print(a.error);
+      mpc_err_delete(a.error);
+      return 1;
+    }
+    
+    secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%8d %10.1f %12.3f\n", depth, secs * 1e3, secs * 1e6 / depth);
+    
+    mpc_ast_delete(a.output);
+    free(input);
+  }
+  
+  mpc_cleanup(3, S, P, Top);
+  
+  return 0;
+}
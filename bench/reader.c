@@ -0,0 +1,67 @@
+/** 
+ * Reading a 50 MB source file with the direct reader and with the mpc one, as the loader does
+ *
+ *   gcc -std=c11 -O2 -pthread bench/reader.c mpc.c -lm -lreadline -o reader && ./reader
+ */
+#define main lispc_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_SIZE (50 * 1024 * 1024)
+#define BENCH_FILE "reader_bench.lsp"
+
+/** 
+ * Lines of source, repeated until the file is big enough
+ */
+static const char* bench_lines[] = {
+    "(def {fib-args} {10 20 30 40 50 60 70 80 90 100 110 120 130 140 150 160 170})\n",
+    "(+ 1 (* 2 3) (- 40 -2) (/ 100 7))\n",
+    "(eval (head {(join {a b c} {d e f}) (list 1 2 3) {nested {deeply {in {here}}}}}))\n",
+    "(def {some-long-symbol-name another_symbol x1 y2 z3} 1 2 3 4 5)\n",
+};
+
+/** 
+ * Time reading the file with `grammar`, or the direct reader if it's NULL
+ */
+void bench_read(const char* name, mpc_parser_t* grammar, mpc_arena_t* arena, long size) {
+    clock_t start = clock();
+    lval* x = lload_read(BENCH_FILE, grammar, NULL, arena);
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    if (x->type == LVAL_ERR) {
+        printf("%s: %s\n", name, x->err);
+    } else {
+        printf("%8s %10.0f ms %10.1f MB/s  %d expressions\n", name, secs * 1e3, size / secs / 1e6, x->count);
+    }
+    lval_del(x);
+}
+
+int main(void) {
+    lval_small_init();
+
+    FILE* f = fopen(BENCH_FILE, "wb");
+    if (f == NULL) {
+        printf("Could not write '%s'\n", BENCH_FILE);
+        return 1;
+    }
+
+    long size = 0;
+    for (int i = 0; size < BENCH_SIZE; i = (i + 1) % 4) {
+        size += fputs(bench_lines[i], f) >= 0 ? strlen(bench_lines[i]) : 0;
+    }
+    fclose(f);
+
+    mpc_parser_t* grammar = lgrammar_new(NULL);
+    mpc_arena_t* arena = mpc_arena_new();
+
+    bench_read("direct", NULL, NULL, size);
+    bench_read("mpc", grammar, arena, size);
+
+    mpc_arena_delete(arena);
+    lgrammar_del();
+    remove(BENCH_FILE);
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+** Parse time from 1 KB to 100 MB of input
+**
+** Parses words and spaces through `mpc_parse`,
+** `mpc_parse_file` and `mpc_parse_pipe`. Parsing
+** is linear when the time per byte stays flat as
+** the input grows.
+**
+**   gcc -std=c99 -O2 bench/scaling.c mpc.c -lm -o scaling && ./scaling
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "../mpc.h"
+
+#include <time.h>
+
+#define BENCH_FILE "scaling_bench.txt"
+
+static double bench_secs(clock_t start) {
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static int bench_check(int ok, mpc_result_t *r, long size) {
+  if (!ok) {
+    mpc_err_print(r->error);
+    mpc_err_delete(r->error);
+    return 0;
+  }
+  ok = (long)strlen(r->output) == size;
+  free(r->output);
+  return ok;
+}
+
+int main(void) {
+  
+  static const char words[] = "lorem ipsum dolor sit amet consectetur adipiscing elit\n";
+  
+  mpc_parser_t *p = mpc_total(mpc_many(mpcf_strfold, mpc_or(2, mpc_ident(), mpc_whitespace())), free);
+  mpc_result_t r;
+  clock_t start;
+  double t0, t1, t2;
+  long size, n;
+  char *s;
+  FILE *f;
+  
+  printf("%10s %14s %14s %14s\n", "bytes", "string ns/B", "file ns/B", "pipe ns/B");
+  
+  for (size = 1024; size <= 100L * 1024 * 1024; size *= 10) {
+    
+    /* Whole lines of words, cut short at the size */
+    
+    s = malloc(size + 1);
+    for (n = 0; n < size; n++) { s[n] = words[n % (sizeof(words) - 1)]; }
+    s[size] = '\0';
+    
+    f = fopen(BENCH_FILE, "wb");
+    if (f == NULL) { printf("Could not write '%s'\n", BENCH_FILE); return 1; }
+    fwrite(s, 1, size, f);
+    fclose(f);
+    
+    start = clock();
+    if (!bench_check(mpc_parse("<string>", s, p, &r), &r, size)) { return 1; }
+    t0 = bench_secs(start);
+    
+    f = fopen(BENCH_FILE, "rb");
+    start = clock();
+    if (!bench_check(mpc_parse_file(BENCH_FILE, f, p, &r), &r, size)) { return 1; }
+    t1 = bench_secs(start);
+    fclose(f);
+    
+    /* Only the reading side of the pipe counts, as clock only measures this process */
+    
+    f = popen("cat " BENCH_FILE, "r");
+    start = clock();
+    if (!bench_check(mpc_parse_pipe("<pipe>", f, p, &r), &r, size)) { return 1; }
+    t2 = bench_secs(start);
+    pclose(f);
+    
+    printf("%10ld %14.2f %14.2f %14.2f\n", size, t0 * 1e9 / size, t1 * 1e9 / size, t2 * 1e9 / size);
+    fflush(stdout);
+    
+    free(s);
+  }
+  
+  remove(BENCH_FILE);
+  mpc_delete(p);
+  
+  return 0;
+}
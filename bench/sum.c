@@ -0,0 +1,105 @@
+/** 
+ * Summing 10M numbers with `+`. The old `builtin_op`, which picked the operator by comparing its name for
+ * every element, is rebuilt here and compared with `builtin_add` on the same arguments, and on a packed
+ * q-expression of them
+ *
+ *   gcc -std=c11 -O2 -pthread bench/sum.c mpc.c -lm -lreadline -o sum && ./sum
+ */
+#define main lispc_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_COUNT 10000000
+
+/** 
+ * `builtin_op` as it was, but for copying the first number rather than changing a shared one. It was
+ * shared by the four operators, so it isn't specialized for one of them here either
+ */
+__attribute__((noinline, noclone))
+lval* bench_op_by_name(lenv* e, lval* a, char* op) {
+    for (int i = 0; i < a->count; ++i) {
+        if (a->cell[i]->type != LVAL_NUM) {
+            lval_del(a);
+            return lval_err("Cannot operate on non-number");
+        }
+    }
+
+    /* A node of its own, as small numbers from `lval_num` are shared */
+    lval* y = lval_pop(a, 0);
+    lval* x = lval_alloc();
+    x->type = LVAL_NUM;
+    x->refs = 1;
+    x->num  = y->num;
+    lval_del(y);
+
+    if ((strcmp(op, "-") == 0) && a->count == 0) { x->num = -x->num; }
+
+    while (a->count > 0) {
+        lval* y = lval_pop(a, 0);
+
+        if (strcmp(op, "+") == 0) { x->num += y->num; }
+        if (strcmp(op, "-") == 0) { x->num -= y->num; }
+        if (strcmp(op, "*") == 0) { x->num *= y->num; }
+        if (strcmp(op, "/") == 0) {
+            if (y->num == 0) {
+                lval_del(x);
+                lval_del(y);
+
+                x = lval_err("Division by zero");
+                break;
+            }
+
+            x->num /= y->num;
+        }
+
+        lval_del(y);
+    }
+
+    lval_del(a);
+
+    return x;
+}
+
+/** 
+ * The arguments of a sum of BENCH_COUNT numbers, or with `packed` set a single packed q-expression of them
+ */
+lval* bench_args(int packed) {
+    lval* v = packed ? lval_qexpr() : lval_sexpr();
+    for (int i = 0; i < BENCH_COUNT; ++i) { v = lval_add(v, lval_num(i % 1000)); }
+    if (!packed) { return v; }
+
+    lval_pack(v);
+    return lval_add(lval_sexpr(), v);
+}
+
+/** 
+ * Time `f` summing `a`
+ */
+void bench_run(const char* name, lval* (*f)(lenv*, lval*), lval* a) {
+    clock_t start = clock();
+    lval* x = f(NULL, a);
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%16s %10.2f ms %10.2f ns/element  sum %ld\n", name, secs * 1e3, secs * 1e9 / BENCH_COUNT, x->num);
+    lval_del(x);
+}
+
+/** 
+ * `bench_op_by_name` for `+`
+ */
+lval* bench_add_by_name(lenv* e, lval* a) {
+    return bench_op_by_name(e, a, "+");
+}
+
+int main(void) {
+    lval_small_init();
+    lnums_init();
+
+    bench_run("by name", bench_add_by_name, bench_args(0));
+    bench_run("kernel", builtin_add, bench_args(0));
+    bench_run("packed kernel", builtin_add, bench_args(1));
+
+    return 0;
+}
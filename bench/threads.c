@@ -0,0 +1,132 @@
+/*
+** Parsing on many threads with one grammar
+**
+** Each of N threads parses a script of its own
+** with the same parsers, using a context and an
+** arena of its own. With nothing shared but the
+** parsers, which are never written during a
+** parse, throughput should grow with N up to the
+** number of cores.
+**
+**   gcc -std=c99 -O2 -pthread bench/threads.c mpc.c -lm -o threads && ./threads [max-threads]
+**
+** The thread count doubles up to max-threads, which
+** defaults to the number of online cores.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "../mpc.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SIZE (4 * 1024 * 1024)
+#define BENCH_THREADS_MAX 64
+
+static mpc_parser_t *bench_grammar;
+
+typedef struct {
+  char *script;
+  int length;
+  int ok;
+} bench_job_t;
+
+static char *bench_script(int seed, int *length) {
+  
+  static const char *lines[] = {
+    "(def {xs} {1 2 3 4 5 6 7 8 9 10})\n",
+    "(+ 1 (* 2 3) (- 40 -2) (/ 100 7))\n",
+    "(eval (head {(join {a b c} {d e f}) (list 1 2 3)}))\n",
+    "(def {some-long-symbol-name another_symbol} 1 2)\n"
+  };
+  
+  char *s = malloc(BENCH_SIZE + 128);
+  int n = 0, k = seed;
+  
+  while (n < BENCH_SIZE) {
+    strcpy(s + n, lines[k % 4]);
+    n += strlen(lines[k % 4]);
+    k++;
+  }
+  
+  *length = n;
+  return s;
+}
+
+static void *bench_worker(void *arg) {
+  
+  bench_job_t *j = arg;
+  mpc_context_t *c = mpc_context_new();
+  mpc_arena_t *a = mpc_arena_new();
+  mpc_result_t r;
+  
+  j->ok = mpc_parse_context(c, "<bench>", j->script, j->length, bench_grammar, a, &r);
+  if (!j->ok) { mpc_err_print(r.error); mpc_err_delete(r.error); }
+  
+  mpc_arena_delete(a);
+  mpc_context_delete(c);
+  return NULL;
+}
+
+static double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *Sexpr  = mpc_new("sexpr");
+  mpc_parser_t *Qexpr  = mpc_new("qexpr");
+  mpc_parser_t *Expr   = mpc_new("expr");
+  mpc_parser_t *Lispc  = mpc_new("lispc");
+  
+  bench_job_t jobs[BENCH_THREADS_MAX];
+  pthread_t threads[BENCH_THREADS_MAX];
+  int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  double start, secs, base = 0;
+  int n, i, ok;
+  
+  mpc_err_t *err = mpca_lang(MPC_LANG_DEFAULT,
+    " number : /-?[0-9]+/ ;                                \
+      symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;          \
+      sexpr  : '(' <expr>* ')' ;                           \
+      qexpr  : '{' <expr>* '}' ;                           \
+      expr   : <number> | <symbol> | <sexpr> | <qexpr> ;   \
+      lispc  : /^/ <expr>* /$/ ;                           ",
+    Number, Symbol, Sexpr, Qexpr, Expr, Lispc, NULL);
+  
+  if (err) { mpc_err_print(err); mpc_err_delete(err); return 1; }
+  bench_grammar = Lispc;
+  
+  if (argc > 1) { cores = atoi(argv[1]); }
+  if (cores < 1) { cores = 1; }
+  if (cores > BENCH_THREADS_MAX) { cores = BENCH_THREADS_MAX; }
+  
+  for (i = 0; i < cores; i++) { jobs[i].script = bench_script(i, &jobs[i].length); }
+  
+  printf("%8s %10s %10s %10s\n", "threads", "ms", "MB/s", "speedup");
+  
+  for (n = 1; n <= cores; n = n * 2 > cores && n < cores ? cores : n * 2) {
+    
+    start = bench_now();
+    for (i = 0; i < n; i++) { pthread_create(&threads[i], NULL, bench_worker, &jobs[i]); }
+    for (i = 0; i < n; i++) { pthread_join(threads[i], NULL); }
+    secs = bench_now() - start;
+    
+    for (ok = 1, i = 0; i < n; i++) { ok = ok && jobs[i].ok; }
+    if (!ok) { return 1; }
+    
+    if (n == 1) { base = secs; }
+    printf("%8d %10.0f %10.1f %10.2f\n", n, secs * 1e3, (double)n * BENCH_SIZE / secs / 1e6, n * base / secs);
+  }
+  
+  for (i = 0; i < cores; i++) { free(jobs[i].script); }
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispc);
+  
+  return 0;
+}
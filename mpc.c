@@ -1,5 +1,23 @@
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_MMAP
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_THREADS
+#include <pthread.h>
+#endif
+
 /*
 ** State Type
 */
@@ -54,6 +72,7 @@ static mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *
 void mpc_err_delete(mpc_err_t *x) {
 
   int i;
+  if (x == NULL) { return; }
   for (i = 0; i < x->expected_num; i++) {
     free(x->expected[i]);
   }
@@ -64,6 +83,30 @@ void mpc_err_delete(mpc_err_t *x) {
   free(x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  
+  int i;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = malloc(sizeof(mpc_err_t));
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = malloc(sizeof(char*) * x->expected_num);
+  for (i = 0; i < x->expected_num; i++) {
+    y->expected[i] = malloc(strlen(x->expected[i]) + 1);
+    strcpy(y->expected[i], x->expected[i]);
+  }
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  return y;
+  
+}
+
 static int mpc_err_contains_expected(mpc_err_t *x, char *expected) {
   
   int i;
@@ -116,13 +159,9 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char *fmt, ...) {
   va_end(va);
 }
 
-static char char_unescape_buffer[3];
+/* Any plain character is written into `buffer` which must fit four */
 
-static char *mpc_err_char_unescape(char c) {
-  
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
+static char *mpc_err_char_unescape(char c, char *buffer) {
   
   switch (c) {
     
@@ -136,8 +175,11 @@ static char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[0] = '\'';
+      buffer[1] = c;
+      buffer[2] = '\'';
+      buffer[3] = '\0';
+      return buffer;
   }
   
 }
@@ -145,6 +187,7 @@ static char *mpc_err_char_unescape(char c) {
 char *mpc_err_string(mpc_err_t *x) {
   
   char *buffer = calloc(1, 1024);
+  char unescaped[4];
   int max = 1023;
   int pos = 0; 
   int i;
@@ -174,16 +217,31 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->state.next));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->state.next, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
 }
 
+/*
+** A NULL error is one that was never built
+** (see `mpc_parse_lazy`) so merging with one
+** gives NULL too.
+*/
+
 static mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
   
   int i, j;
-  mpc_err_t *e = malloc(sizeof(mpc_err_t));
+  mpc_err_t *e;
+  
+  for (i = 0; i < n; i++) {
+    if (x[i] == NULL) {
+      for (j = 0; j < n; j++) { mpc_err_delete(x[j]); }
+      return NULL;
+    }
+  }
+  
+  e = malloc(sizeof(mpc_err_t));
   e->state = mpc_state_invalid();
   e->expected_num = 0;
   e->expected = NULL;
@@ -220,7 +278,9 @@ static mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
 static mpc_err_t *mpc_err_repeat(mpc_err_t *x, const char *prefix) {
 
   int i;
-  char *expect = malloc(strlen(prefix) + 1);
+  char *expect;
+  if (x == NULL) { return NULL; }
+  expect = malloc(strlen(prefix) + 1);
   strcpy(expect, prefix);
   
   if (x->expected_num == 1) {
@@ -258,13 +318,85 @@ static mpc_err_t *mpc_err_many1(mpc_err_t *x) {
 static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
-  char *prefix = malloc(digits + strlen(" of ") + 1);
+  char *prefix;
+  if (x == NULL) { return NULL; }
+  prefix = malloc(digits + strlen(" of ") + 1);
   sprintf(prefix, "%i of ", n);
   y = mpc_err_repeat(x, prefix);
   free(prefix);
   return y;
 }
 
+/*
+** Contexts
+**
+** Parsing never changes a parser, so once built a
+** grammar can be shared by any number of threads.
+** Everything a parse does change is kept in a
+** context instead: the inputs and stacks kept for
+** reuse, and a cache of the tags looked up so far.
+** A context must only be used by one parse at a
+** time.
+**
+** Parses which aren't given a context borrow one
+** from a shared pool for as long as they run. The
+** pool, and the table of tags behind the caches,
+** are the only things shared between threads and
+** are guarded by a single lock.
+*/
+
+#ifdef MPC_THREADS
+static pthread_mutex_t mpc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void mpc_lock(void) { pthread_mutex_lock(&mpc_mutex); }
+static void mpc_unlock(void) { pthread_mutex_unlock(&mpc_mutex); }
+#else
+static void mpc_lock(void) { }
+static void mpc_unlock(void) { }
+#endif
+
+#define MPC_TAG_CACHE 256
+
+typedef struct {
+  const char *t;
+  int x;
+  int id;
+} mpc_tag_cache_t;
+
+struct mpc_context_t {
+  struct mpc_input_t *inputs;
+  struct mpc_stack_t *stacks;
+  mpc_tag_cache_t tags[MPC_TAG_CACHE];
+  struct mpc_context_t *next;
+};
+
+static mpc_context_t *mpc_contexts = NULL;
+
+mpc_context_t *mpc_context_new(void) {
+  int i;
+  mpc_context_t *c = malloc(sizeof(mpc_context_t));
+  c->inputs = NULL;
+  c->stacks = NULL;
+  for (i = 0; i < MPC_TAG_CACHE; i++) { c->tags[i].t = NULL; }
+  c->next = NULL;
+  return c;
+}
+
+static mpc_context_t *mpc_context_take(void) {
+  mpc_context_t *c;
+  mpc_lock();
+  c = mpc_contexts;
+  if (c) { mpc_contexts = c->next; }
+  mpc_unlock();
+  return c ? c : mpc_context_new();
+}
+
+static void mpc_context_give(mpc_context_t *c) {
+  mpc_lock();
+  c->next = mpc_contexts;
+  mpc_contexts = c;
+  mpc_unlock();
+}
+
 /*
 ** Input Type
 */
@@ -274,9 +406,11 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** operation: String, File and Pipe.
 **
 ** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
+** already in memory and scanned through.
 ** The cursor can jump around at will making 
-** backtracking easy.
+** backtracking easy. The string is never
+** copied, only read where the caller left it,
+** so it may be any length and hold NUL bytes.
 **
 ** The second is a File which is also somewhat
 ** easy. The contents are never loaded into 
@@ -298,15 +432,34 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
 **
+** The length of the string, and the length and
+** capacity of the pipe buffer, are kept in the
+** input so that reading never has to scan them.
+**
+** The marks, and the pipe buffer, only ever grow.
+** Inputs are kept once deleted and used again by
+** later parses, so after the first few parses
+** marking and buffering don't allocate at all.
+**
+** Where mmap is available, regular files are
+** not read through stdio at all. They are mapped
+** into memory and parsed just like a String,
+** with the file positioned after the consumed
+** input once parsing is done. Only pipes, and
+** files which can't be mapped, are streamed.
+** Positions are ints, so files with more than
+** INT_MAX bytes left to parse aren't mapped.
+**
 */
 
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 2,
+  MPC_INPUT_MMAP   = 3
 };
 
-typedef struct {
+typedef struct mpc_input_t {
 
   int type;
   char *filename;  
@@ -316,72 +469,114 @@ typedef struct {
   char *buffer;
   FILE *file;
   
+  int length;
+  int buffer_num;
+  int buffer_slots;
+  
+  void *map;
+  size_t map_size;
+  
   int backtrack;
   int marks_num;
+  int marks_slots;
   mpc_state_t* marks;
   
+  int recog;
+  mpc_arena_t *arena;
+  
+  mpc_context_t *ctx;
+  int ctx_borrowed;
+  
+  struct mpc_input_t *next;
+  
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+/* Without a context `c` one is borrowed from the pool until the input is deleted */
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+static mpc_input_t *mpc_input_new(mpc_context_t *c, const char *filename, int type) {
+  
+  int borrowed = c == NULL;
+  mpc_input_t *i;
+  
+  if (borrowed) { c = mpc_context_take(); }
+  
+  i = c->inputs;
+  
+  if (i) {
+    c->inputs = i->next;
+  } else {
+    i = malloc(sizeof(mpc_input_t));
+    i->buffer = NULL;
+    i->buffer_slots = 0;
+    i->marks = NULL;
+    i->marks_slots = 0;
+  }
   
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
-  
+  i->type = type;
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
-  i->buffer = NULL;
+  i->string = NULL;
   i->file = NULL;
+  i->length = 0;
+  i->buffer_num = 0;
+  i->map = NULL;
+  i->map_size = 0;
   
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks = NULL;
+  i->recog = 0;
+  i->arena = NULL;
+  i->ctx = c;
+  i->ctx_borrowed = borrowed;
+  i->next = NULL;
   
   return i;
 }
 
-static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
+static mpc_input_t *mpc_input_new_string(mpc_context_t *c, const char *filename, const char *string, int length) {
+  mpc_input_t *i = mpc_input_new(c, filename, MPC_INPUT_STRING);
+  i->length = length;
+  i->string = (char*)string;
+  return i;
+}
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-  
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  
-  i->type = MPC_INPUT_PIPE;
-  i->state = mpc_state_new();
-  
-  i->string = NULL;
-  i->buffer = NULL;
+static mpc_input_t *mpc_input_new_pipe(mpc_context_t *c, const char *filename, FILE *pipe) {
+  mpc_input_t *i = mpc_input_new(c, filename, MPC_INPUT_PIPE);
   i->file = pipe;
-  
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks = NULL;
-  
   return i;
-  
 }
 
-static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
-  
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+static mpc_input_t *mpc_input_new_file(mpc_context_t *c, const char *filename, FILE *file) {
   
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
+  mpc_input_t *i = mpc_input_new(c, filename, MPC_INPUT_FILE);
+#ifdef MPC_MMAP
+  struct stat st;
+  off_t offset;
+#endif
   
-  i->string = NULL;
-  i->buffer = NULL;
   i->file = file;
   
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks = NULL;
+#ifdef MPC_MMAP
+  
+  /* Map regular files, starting from where the file currently is */
+  
+  offset = ftello(file);
+  if (offset >= 0 && fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > offset
+  &&  st.st_size - offset <= INT_MAX && (uintmax_t)st.st_size <= SIZE_MAX) {
+    i->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (i->map == MAP_FAILED) {
+      i->map = NULL;
+    } else {
+      i->type = MPC_INPUT_MMAP;
+      i->map_size = (size_t)st.st_size;
+      i->string = (char*)i->map + offset;
+      i->length = (int)(st.st_size - offset);
+    }
+  }
+  
+#endif
   
   return i;
 }
@@ -390,11 +585,17 @@ static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+#ifdef MPC_MMAP
+  if (i->type == MPC_INPUT_MMAP) {
+    fseeko(i->file, (off_t)(i->string - (char*)i->map) + i->state.pos, SEEK_SET);
+    munmap(i->map, i->map_size);
+  }
+#endif
+  
+  i->next = i->ctx->inputs;
+  i->ctx->inputs = i;
   
-  free(i->marks);
-  free(i);
+  if (i->ctx_borrowed) { mpc_context_give(i->ctx); }
 }
 
 static void mpc_input_backtrack_disable(mpc_input_t *i) { i->backtrack--; }
@@ -404,12 +605,19 @@ static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
-  i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->marks[i->marks_num-1] = i->state;
+  if (i->marks_num == i->marks_slots) {
+    i->marks_slots = i->marks_slots ? i->marks_slots * 2 : 16;
+    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+  }
+  
+  i->marks[i->marks_num++] = i->state;
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+    i->buffer_num = 0;
+    if (i->buffer_slots == 0) {
+      i->buffer_slots = 64;
+      i->buffer = malloc(i->buffer_slots);
+    }
   }
   
 }
@@ -419,11 +627,9 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
+    i->buffer_num = 0;
   }
   
 }
@@ -442,7 +648,7 @@ static void mpc_input_rewind(mpc_input_t *i) {
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < (i->buffer_num + i->marks[0].pos);
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
@@ -450,7 +656,8 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == i->length) { return 1; }
+  if (i->type == MPC_INPUT_MMAP && i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -461,13 +668,14 @@ static char mpc_input_getc(mpc_input_t *i) {
   char c;
   switch (i->type) {
     
-    case MPC_INPUT_STRING: c = i->string[i->state.pos]; break;
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP: c = i->state.pos < i->length ? i->string[i->state.pos] : '\0'; break;
     case MPC_INPUT_FILE: c = fgetc(i->file); break;
     case MPC_INPUT_PIPE:
     
-      if (!i->buffer) { c = getc(i->file); break; }
+      if (!i->marks_num) { c = getc(i->file); break; }
       
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         c = mpc_input_buffer_get(i);
       } else {
         c = getc(i->file);
@@ -484,12 +692,13 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
   switch (i->type) {
     case MPC_INPUT_STRING: break;
+    case MPC_INPUT_MMAP: break;
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); break;
     case MPC_INPUT_PIPE:
       
-      if (!i->buffer) { ungetc(c, i->file); break; }
+      if (!i->marks_num) { ungetc(c, i->file); break; }
       
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         break;
       } else {
         ungetc(c, i->file); 
@@ -504,12 +713,14 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
   if (i->type == MPC_INPUT_PIPE &&
-      i->buffer &&
+      i->marks_num &&
       !mpc_input_buffer_in_range(i)) {
     
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+    if (i->buffer_num == i->buffer_slots) {
+      i->buffer_slots *= 2;
+      i->buffer = realloc(i->buffer, i->buffer_slots);
+    }
+    i->buffer[i->buffer_num++] = c;
   }
 
   i->state.pos++;
@@ -557,16 +768,22 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
+/* A NUL in the input is never one of the characters `c`, which `strchr` would say */
+
+static int mpc_input_in(const char *c, char x) {
+  return x != '\0' && strchr(c, x) != 0;
+}
+
 static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { i->state.next = '\0'; return 0; }
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return mpc_input_in(c, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { i->state.next = '\0'; return 0; }
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return !mpc_input_in(c, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -577,23 +794,30 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
 
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   
-  char *co = NULL;
   const char *x = c;
-
-  mpc_input_mark(i);
-  while (*x) {
-    if (mpc_input_char(i, *x, &co)) {
-      free(co);
-    } else {
-      mpc_input_rewind(i);
-      return 0;
+  int n = strlen(c);
+  
+  /* In memory the string can just be compared, as failing would rewind to here anyway */
+  
+  if ((i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP) && i->backtrack > 0) {
+    if (i->length - i->state.pos < n || memcmp(i->string + i->state.pos, c, n) != 0) { return 0; }
+    while (*x) { mpc_input_success(i, *x++, NULL); }
+  } else {
+    mpc_input_mark(i);
+    while (*x) {
+      if (!mpc_input_char(i, *x, NULL)) {
+        mpc_input_rewind(i);
+        return 0;
+      }
+      x++;
     }
-    x++;
+    mpc_input_unmark(i);
   }
-  mpc_input_unmark(i);
   
-  *o = malloc(strlen(c) + 1);
-  strcpy(*o, c);
+  if (o) {
+    *o = malloc(n + 1);
+    strcpy(*o, c);
+  }
   return 1;
 }
 
@@ -629,9 +853,13 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_DFA       = 25
 };
 
+typedef struct mpc_dfa_t mpc_dfa_t;
+
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
@@ -644,8 +872,9 @@ typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_t
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned long *first; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_dfa_t *d; mpc_parser_t *x; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -662,178 +891,675 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
+/*
+** Parsers made by the `mpca_*` functions say which
+** AST function they apply, so a parse can do the
+** same through its context and arena instead. Ones
+** which only destroy AST nodes on failure say so
+** too. Parsers made by the other functions always
+** call the functions they were given.
+*/
+
+enum {
+  MPC_AST_NONE    = 0,
+  MPC_AST_DELETE  = 1,
+  MPC_AST_STR     = 2,
+  MPC_AST_ROOT    = 3,
+  MPC_AST_TAG     = 4,
+  MPC_AST_ADD_TAG = 5,
+  MPC_AST_FOLD    = 6
+};
+
 struct mpc_parser_t {
   char retained;
   char *name;
   char type;
+  char ast;
   mpc_pdata_t data;
 };
 
 /*
-** Stack Type
+** Tags
+**
+** The tag of every AST node is interned, so tagging
+** a node never allocates once its tag has been seen
+** before, and nodes share their tag strings. Each
+** tag also has an id. A tag made of several, such
+** as `expr|number`, knows the ids of its first part
+** and of the rest, so the parts can be looked at
+** without touching the strings.
+**
+** The tags are kept in chunks which never move, so
+** once a thread has been given an id it can read
+** that tag without taking the lock. Only adding
+** and finding tags needs the lock, and parses skip
+** even that for tags their context has cached.
 */
 
+#define MPC_TAG_CHUNK 1024
+#define MPC_TAG_CHUNKS 4096
+
 typedef struct {
+  char *name;
+  int head;
+  int rest;
+} mpc_tag_t;
 
-  int parsers_num;
-  int parsers_slots;
-  mpc_parser_t **parsers;
-  int *states;
+static struct {
+  mpc_tag_t *chunks[MPC_TAG_CHUNKS];
+  int tags_num;
+  int *index;
+  int index_slots;
+} mpc_tags;
 
-  int results_num;
-  int results_slots;
-  mpc_result_t *results;
-  int *returns;
+static mpc_tag_t *mpc_tag_get(int id) {
+  return &mpc_tags.chunks[id / MPC_TAG_CHUNK][id % MPC_TAG_CHUNK];
+}
+
+static unsigned long mpc_tag_hash_name(const char *t, size_t n) {
+  unsigned long h = 5381;
+  size_t i;
+  for (i = 0; i < n; i++) { h = h * 33 + (unsigned char)t[i]; }
+  return h;
+}
+
+static unsigned long mpc_tag_hash_pair(int head, int rest) {
+  return (unsigned long)head * 31 + (unsigned long)rest * 2654435761UL;
+}
+
+static void mpc_tag_index(int id) {
   
-  mpc_err_t *err;
+  mpc_tag_t *t = mpc_tag_get(id);
+  unsigned long k = t->rest
+    ? mpc_tag_hash_pair(t->head, t->rest)
+    : mpc_tag_hash_name(t->name, strlen(t->name));
   
-} mpc_stack_t;
+  k &= mpc_tags.index_slots - 1;
+  while (mpc_tags.index[k]) { k = (k + 1) & (mpc_tags.index_slots - 1); }
+  mpc_tags.index[k] = id;
+}
+
+/*
+** Adds a new tag. Single tags are their own head.
+** Id 0 is no tag at all. Running out of ids means
+** something is making tags without end, and since
+** a node must always have a tag it is fatal.
+*/
 
-static mpc_stack_t *mpc_stack_new(const char *filename) {
-  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+static int mpc_tag_new(char *name, int head, int rest) {
   
-  s->parsers_num = 0;
-  s->parsers_slots = 0;
-  s->parsers = NULL;
-  s->states = NULL;
+  int i, id;
+  mpc_tag_t *t;
   
-  s->results_num = 0;
-  s->results_slots = 0;
-  s->results = NULL;
-  s->returns = NULL;
+  if (mpc_tags.tags_num == 0) { mpc_tags.tags_num = 1; }
   
-  s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
+  id = mpc_tags.tags_num;
+  if (id / MPC_TAG_CHUNK >= MPC_TAG_CHUNKS) {
+    fprintf(stderr, "mpc: out of tag ids interning '%s', at most %d tags can be made\n",
+      name, MPC_TAG_CHUNK * MPC_TAG_CHUNKS - 1);
+    abort();
+  }
   
-  return s;
+  if (mpc_tags.chunks[id / MPC_TAG_CHUNK] == NULL) {
+    mpc_tags.chunks[id / MPC_TAG_CHUNK] = calloc(MPC_TAG_CHUNK, sizeof(mpc_tag_t));
+  }
+  
+  mpc_tags.tags_num++;
+  t = mpc_tag_get(id);
+  t->name = name;
+  t->head = rest ? head : id;
+  t->rest = rest;
+  
+  if (mpc_tags.tags_num * 2 > mpc_tags.index_slots) {
+    mpc_tags.index_slots = mpc_tags.index_slots ? mpc_tags.index_slots * 2 : 128;
+    free(mpc_tags.index);
+    mpc_tags.index = calloc(mpc_tags.index_slots, sizeof(int));
+    for (i = 1; i < mpc_tags.tags_num; i++) { mpc_tag_index(i); }
+  } else {
+    mpc_tag_index(id);
+  }
+  
+  return id;
 }
 
-static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
-  mpc_err_t *errs[2];
-  errs[0] = s->err;
-  errs[1] = e;
-  s->err = mpc_err_or(errs, 2);
+static int mpc_tag_single(const char *t, size_t n) {
+  
+  int id;
+  char *name;
+  unsigned long k;
+  
+  if (mpc_tags.index_slots) {
+    k = mpc_tag_hash_name(t, n) & (mpc_tags.index_slots - 1);
+    while ((id = mpc_tags.index[k])) {
+      name = mpc_tag_get(id)->name;
+      if (mpc_tag_get(id)->rest == 0 && strlen(name) == n && memcmp(name, t, n) == 0) { return id; }
+      k = (k + 1) & (mpc_tags.index_slots - 1);
+    }
+  }
+  
+  name = malloc(n + 1);
+  memcpy(name, t, n);
+  name[n] = '\0';
+  return mpc_tag_new(name, 0, 0);
 }
 
-static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
-  int success = s->returns[0];
+static int mpc_tag_pair(int head, int rest) {
   
-  if (success) {
-    r->output = s->results[0].output;
-    mpc_err_delete(s->err);
-  } else {
-    mpc_stack_err(s, s->results[0].error);
-    r->error = s->err;
-  }
+  int id;
+  char *name;
+  unsigned long k;
   
-  free(s->parsers);
-  free(s->states);
-  free(s->results);
-  free(s->returns);
-  free(s);
+  if (rest == 0) { return head; }
   
-  return success;
+  if (mpc_tags.index_slots) {
+    k = mpc_tag_hash_pair(head, rest) & (mpc_tags.index_slots - 1);
+    while ((id = mpc_tags.index[k])) {
+      if (mpc_tag_get(id)->rest == rest && mpc_tag_get(id)->head == head) { return id; }
+      k = (k + 1) & (mpc_tags.index_slots - 1);
+    }
+  }
+  
+  name = malloc(strlen(mpc_tag_get(head)->name) + 1 + strlen(mpc_tag_get(rest)->name) + 1);
+  strcpy(name, mpc_tag_get(head)->name);
+  strcat(name, "|");
+  strcat(name, mpc_tag_get(rest)->name);
+  return mpc_tag_new(name, head, rest);
 }
 
-/* Stack Parser Stuff */
+/* The tag `t` in front of the tag `x` */
 
-static void mpc_stack_set_state(mpc_stack_t *s, int x) {
-  s->states[s->parsers_num-1] = x;
+static int mpc_tag_prepend(int t, int x) {
+  if (mpc_tag_get(t)->rest == 0) { return mpc_tag_pair(t, x); }
+  return mpc_tag_pair(mpc_tag_get(t)->head, mpc_tag_prepend(mpc_tag_get(t)->rest, x));
 }
 
-static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
-  if (s->parsers_num > s->parsers_slots) {
-    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-  }
+static int mpc_tag_find(const char *t) {
+  const char *bar = strchr(t, '|');
+  if (bar == NULL) { return mpc_tag_single(t, strlen(t)); }
+  return mpc_tag_pair(mpc_tag_single(t, bar - t), mpc_tag_find(bar + 1));
 }
 
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-  }
-}
+/* The tag `t` in front of the tag `x`, or just `t` when `x` is 0 */
 
-static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
-  s->parsers_num++;
-  mpc_stack_parsers_reserve_more(s);
-  s->parsers[s->parsers_num-1] = p;
-  s->states[s->parsers_num-1] = 0;
+static int mpc_tag_add(const char *t, int x) {
+  int id;
+  mpc_lock();
+  id = mpc_tag_prepend(mpc_tag_find(t), x);
+  mpc_unlock();
+  return id;
 }
 
-static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-  *p = s->parsers[s->parsers_num-1];
-  *st = s->states[s->parsers_num-1];
-  s->parsers_num--;
-  mpc_stack_parsers_reserve_less(s);
-}
+/*
+** The same as `mpc_tag_add` but cached in the
+** context by the address of `t`. The name is
+** checked on a hit in case the string at that
+** address has since been changed.
+*/
 
-static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-  *p = s->parsers[s->parsers_num-1];
-  *st = s->states[s->parsers_num-1];
+static int mpc_context_tag(mpc_context_t *c, const char *t, int x) {
+  
+  unsigned long k = ((unsigned long)t >> 3) ^ ((unsigned long)x * 31);
+  mpc_tag_cache_t *e = &c->tags[k & (MPC_TAG_CACHE - 1)];
+  const char *name;
+  size_t n;
+  
+  if (e->t == t && e->x == x) {
+    name = mpc_tag_get(e->id)->name;
+    n = strlen(t);
+    if (strncmp(name, t, n) == 0 && (name[n] == '\0' || name[n] == '|')) { return e->id; }
+  }
+  
+  e->t = t;
+  e->x = x;
+  e->id = mpc_tag_add(t, x);
+  return e->id;
 }
 
-static int mpc_stack_empty(mpc_stack_t *s) {
-  return s->parsers_num == 0;
+int mpc_tag_id(const char *t) { return mpc_tag_add(t, 0); }
+int mpc_tag_head(int id) { return mpc_tag_get(id)->head; }
+int mpc_tag_rest(int id) { return mpc_tag_get(id)->rest; }
+
+static void mpc_ast_set_tag(mpc_ast_t *a, int id) {
+  a->tag_id = id;
+  a->tag = mpc_tag_get(id)->name;
 }
 
-/* Stack Result Stuff */
+/*
+** Arenas
+**
+** Parsing into an arena puts the AST in it rather
+** than making three allocations for every node and
+** growing each children array one at a time. The
+** AST functions used by `mpca_lang` are swapped
+** for ones using the arena as they are called, and
+** the whole tree goes at once when the arena is
+** cleared. Trees in an arena must never be given
+** to `mpc_ast_delete`, so only parsers made with
+** `mpca_lang` and the `mpca_*` functions may build
+** them.
+**
+** An arena is a list of blocks which are kept when
+** it is cleared, so after the first few parses it
+** stops calling malloc at all.
+*/
 
-static mpc_result_t mpc_result_err(mpc_err_t *e) {
-  mpc_result_t r;
-  r.error = e;
-  return r;
-}
+#define MPC_ARENA_BLOCK 16384
 
-static mpc_result_t mpc_result_out(mpc_val_t *x) {
-  mpc_result_t r;
-  r.output = x;
-  return r;
-}
+typedef union {
+  long l;
+  double d;
+  void *p;
+} mpc_arena_align_t;
+
+typedef struct mpc_arena_block_t {
+  struct mpc_arena_block_t *next;
+  size_t size;
+  mpc_arena_align_t data[1];
+} mpc_arena_block_t;
+
+struct mpc_arena_t {
+  mpc_arena_block_t *first;
+  mpc_arena_block_t *cur;
+  size_t used;
+};
 
-static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
-  if (s->results_num > s->results_slots) {
-    s->results_slots = ceil((s->results_slots + 1) * 1.5);
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
-  }
+typedef struct {
+  mpc_arena_block_t *cur;
+  size_t used;
+} mpc_arena_mark_t;
+
+mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_t *a = malloc(sizeof(mpc_arena_t));
+  a->first = NULL;
+  a->cur = NULL;
+  a->used = 0;
+  return a;
 }
 
-static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-  if ( s->results_slots > pow(s->results_num+1, 1.5)) {
-    s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
-  }
+void mpc_arena_clear(mpc_arena_t *a) {
+  a->cur = NULL;
+  a->used = 0;
 }
 
-static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
-  s->results_num++;
-  mpc_stack_results_reserve_more(s);
-  s->results[s->results_num-1] = x;
-  s->returns[s->results_num-1] = r;
+void mpc_arena_delete(mpc_arena_t *a) {
+  mpc_arena_block_t *b = a->first, *n;
+  while (b) {
+    n = b->next;
+    free(b);
+    b = n;
+  }
+  free(a);
 }
 
-static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
-  int r;
-  *x = s->results[s->results_num-1];
-  r = s->returns[s->results_num-1];
-  s->results_num--;
-  mpc_stack_results_reserve_less(s);
-  return r;
+static mpc_arena_mark_t mpc_arena_mark(mpc_arena_t *a) {
+  mpc_arena_mark_t m;
+  m.cur = a->cur;
+  m.used = a->used;
+  return m;
 }
 
-static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
-  *x = s->results[s->results_num-1];
-  return s->returns[s->results_num-1];
+static void mpc_arena_rewind(mpc_arena_t *a, mpc_arena_mark_t m) {
+  a->cur = m.cur;
+  a->used = m.used;
 }
 
-static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
-  mpc_result_t x;
+static void *mpc_arena_alloc(mpc_arena_t *a, size_t n) {
+  
+  mpc_arena_block_t *b;
+  size_t size;
+  
+  n = (n + sizeof(mpc_arena_align_t) - 1) / sizeof(mpc_arena_align_t) * sizeof(mpc_arena_align_t);
+  
+  if (a->cur && a->used + n <= a->cur->size) {
+    a->used += n;
+    return (char*)a->cur->data + a->used - n;
+  }
+  
+  /* Move on to the next block, putting a new one in if it is missing or too small */
+  
+  b = a->cur ? a->cur->next : a->first;
+  if (b == NULL || b->size < n) {
+    size = n > MPC_ARENA_BLOCK ? n : MPC_ARENA_BLOCK;
+    b = malloc(sizeof(mpc_arena_block_t) + size);
+    b->size = size;
+    b->next = a->cur ? a->cur->next : a->first;
+    if (a->cur) { a->cur->next = b; } else { a->first = b; }
+  }
+  
+  a->cur = b;
+  a->used = n;
+  return b->data;
+}
+
+/*
+** AST functions during parsing
+**
+** Parsers made by `mpca_lang` and the `mpca_*`
+** functions run these in place of the AST functions
+** they were made with. They do the same but get
+** their tags through the context, and put the nodes
+** in the arena if there is one. Parsers call the
+** other functions through these too, so that when
+** the input is only being recognised no outputs are
+** made and none of them are called.
+*/
+
+static mpc_ast_t *mpc_parse_ast_new(mpc_input_t *i, const char *tag, const char *contents) {
+  
+  size_t n = strlen(contents) + 1;
+  mpc_ast_t *r;
+  
+  if (i->arena) {
+    r = mpc_arena_alloc(i->arena, sizeof(mpc_ast_t) + n);
+    r->contents = (char*)(r + 1);
+  } else {
+    r = malloc(sizeof(mpc_ast_t));
+    r->contents = malloc(n);
+  }
+  
+  mpc_ast_set_tag(r, mpc_context_tag(i->ctx, tag, 0));
+  memcpy(r->contents, contents, n);
+  
+  r->children_num = 0;
+  r->children = NULL;
+  return r;
+}
+
+static mpc_ast_t **mpc_parse_ast_children(mpc_input_t *i, int n) {
+  if (i->arena) { return mpc_arena_alloc(i->arena, sizeof(mpc_ast_t*) * n); }
+  return malloc(sizeof(mpc_ast_t*) * n);
+}
+
+static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_parser_t *p, mpc_val_t *x) {
+  
+  mpc_ast_t *r;
+  
+  if (i->recog) { return NULL; }
+  
+  switch (p->ast) {
+    
+    case MPC_AST_STR:
+      r = mpc_parse_ast_new(i, "", x);
+      free(x);
+      return r;
+    
+    case MPC_AST_ROOT:
+      if (x == NULL || ((mpc_ast_t*)x)->children_num <= 1) { return x; }
+      r = mpc_parse_ast_new(i, ">", "");
+      r->children_num = 1;
+      r->children = mpc_parse_ast_children(i, 1);
+      r->children[0] = x;
+      return r;
+    
+    default: return p->data.apply.f(x);
+  }
+  
+}
+
+static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_parser_t *p, mpc_val_t *x) {
+  
+  mpc_ast_t *a = x;
+  void *d = p->data.apply_to.d;
+  
+  if (i->recog) { return NULL; }
+  
+  switch (p->ast) {
+    
+    case MPC_AST_TAG:
+      mpc_ast_set_tag(a, mpc_context_tag(i->ctx, d, 0));
+      return a;
+    
+    case MPC_AST_ADD_TAG:
+      if (a == NULL) { return a; }
+      mpc_ast_set_tag(a, mpc_context_tag(i->ctx, d, a->tag_id));
+      return a;
+    
+    default: return p->data.apply_to.f(x, d);
+  }
+  
+}
+
+static mpc_val_t *mpc_parse_lift(mpc_input_t *i, mpc_ctor_t f) {
+  return i->recog ? NULL : f();
+}
+
+static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_parser_t *p, mpc_fold_t f, int n, mpc_val_t **xs) {
+  
+  int j, k, l;
+  mpc_ast_t **as = (mpc_ast_t**)xs;
+  mpc_ast_t *r;
+  
+  if (i->recog) { return NULL; }
+  if (p->ast != MPC_AST_FOLD) { return f(n, xs); }
+  
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+  
+  /* Just like `mpcf_fold_ast` but sizing the children first */
+  
+  r = mpc_parse_ast_new(i, ">", "");
+  
+  for (j = 0; j < n; j++) {
+    if (as[j] == NULL) { continue; }
+    r->children_num += as[j]->children_num > 0 ? as[j]->children_num : 1;
+  }
+  
+  if (r->children_num == 0) { return r; }
+  r->children = mpc_parse_ast_children(i, r->children_num);
+  
+  for (j = 0, k = 0; j < n; j++) {
+    if (as[j] == NULL) { continue; }
+    if (as[j]->children_num > 0) {
+      for (l = 0; l < as[j]->children_num; l++) { r->children[k++] = as[j]->children[l]; }
+      if (i->arena == NULL) {
+        free(as[j]->children);
+        free(as[j]->contents);
+        free(as[j]);
+      }
+    } else {
+      r->children[k++] = as[j];
+    }
+  }
+  
+  return r;
+}
+
+/* Nodes in the arena go with it, so the AST parsers never destroy them */
+
+static void mpc_parse_dtor(mpc_input_t *i, mpc_parser_t *p, mpc_dtor_t d, mpc_val_t *x) {
+  if (i->recog) { return; }
+  if (i->arena && p->ast != MPC_AST_NONE) { return; }
+  d(x);
+}
+
+/*
+** Stack Type
+**
+** Like the marks of an input the stacks only grow,
+** doubling when full, and are kept once parsing is
+** done for the next parse to use.
+*/
+
+typedef struct mpc_stack_t {
+
+  int parsers_num;
+  int parsers_slots;
+  mpc_parser_t **parsers;
+  int *states;
+
+  int results_num;
+  int results_slots;
+  mpc_result_t *results;
+  int *returns;
+  
+  mpc_err_t *err;
+  
+  struct mpc_stack_t *next;
+  
+} mpc_stack_t;
+
+static mpc_stack_t *mpc_stack_new(mpc_context_t *c, const char *filename, int lazy) {
+  
+  mpc_stack_t *s = c->stacks;
+  
+  if (s) {
+    c->stacks = s->next;
+  } else {
+    s = malloc(sizeof(mpc_stack_t));
+    s->parsers_slots = 0;
+    s->parsers = NULL;
+    s->states = NULL;
+    s->results_slots = 0;
+    s->results = NULL;
+    s->returns = NULL;
+  }
+  
+  s->parsers_num = 0;
+  s->results_num = 0;
+  s->next = NULL;
+  
+  s->err = lazy ? NULL : mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
+  
+  return s;
+}
+
+static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
+  mpc_err_t *errs[2];
+  errs[0] = s->err;
+  errs[1] = e;
+  s->err = mpc_err_or(errs, 2);
+}
+
+static int mpc_stack_terminate(mpc_context_t *c, mpc_stack_t *s, mpc_result_t *r) {
+  int success = s->returns[0];
+  
+  if (success) {
+    r->output = s->results[0].output;
+    mpc_err_delete(s->err);
+  } else {
+    mpc_stack_err(s, s->results[0].error);
+    r->error = s->err;
+  }
+  
+  s->next = c->stacks;
+  c->stacks = s;
+  
+  return success;
+}
+
+/* Contexts keep their inputs and stacks until deleted */
+
+void mpc_context_delete(mpc_context_t *c) {
+  
+  mpc_input_t *i;
+  mpc_stack_t *s;
+  
+  while (c->inputs) {
+    i = c->inputs;
+    c->inputs = i->next;
+    free(i->buffer);
+    free(i->marks);
+    free(i);
+  }
+  
+  while (c->stacks) {
+    s = c->stacks;
+    c->stacks = s->next;
+    free(s->parsers);
+    free(s->states);
+    free(s->results);
+    free(s->returns);
+    free(s);
+  }
+  
+  free(c);
+}
+
+/* Stack Parser Stuff */
+
+static void mpc_stack_set_state(mpc_stack_t *s, int x) {
+  s->states[s->parsers_num-1] = x;
+}
+
+static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
+  if (s->parsers_num > s->parsers_slots) {
+    s->parsers_slots = s->parsers_slots ? s->parsers_slots * 2 : 64;
+    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
+    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+  }
+}
+
+static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
+  s->parsers_num++;
+  mpc_stack_parsers_reserve_more(s);
+  s->parsers[s->parsers_num-1] = p;
+  s->states[s->parsers_num-1] = 0;
+}
+
+static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+  *p = s->parsers[s->parsers_num-1];
+  *st = s->states[s->parsers_num-1];
+  s->parsers_num--;
+}
+
+static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+  *p = s->parsers[s->parsers_num-1];
+  *st = s->states[s->parsers_num-1];
+}
+
+static int mpc_stack_empty(mpc_stack_t *s) {
+  return s->parsers_num == 0;
+}
+
+/* Stack Result Stuff */
+
+static mpc_result_t mpc_result_err(mpc_err_t *e) {
+  mpc_result_t r;
+  r.error = e;
+  return r;
+}
+
+static mpc_result_t mpc_result_out(mpc_val_t *x) {
+  mpc_result_t r;
+  r.output = x;
+  return r;
+}
+
+static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
+  if (s->results_num > s->results_slots) {
+    s->results_slots = s->results_slots ? s->results_slots * 2 : 64;
+    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
+    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
+  }
+}
+
+static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
+  s->results_num++;
+  mpc_stack_results_reserve_more(s);
+  s->results[s->results_num-1] = x;
+  s->returns[s->results_num-1] = r;
+}
+
+static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
+  int r;
+  *x = s->results[s->results_num-1];
+  r = s->returns[s->results_num-1];
+  s->results_num--;
+  return r;
+}
+
+static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
+  *x = s->results[s->results_num-1];
+  return s->returns[s->results_num-1];
+}
+
+static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
+  mpc_result_t x;
   while (n) {
     mpc_stack_popr(s, &x);
     mpc_stack_err(s, x.error);
@@ -841,42 +1567,876 @@ static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
   }
 }
 
-static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    ds[n-1](x.output);
-    n--;
+static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_parser_t *p, mpc_input_t *i) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    mpc_parse_dtor(i, p, p->data.and.dxs[n-1], x.output);
+    n--;
+  }
+}
+
+static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_parser_t *p, mpc_input_t *i) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    mpc_parse_dtor(i, p, p->data.repeat.dx, x.output);
+    n--;
+  }
+}
+
+static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    n--;
+  }
+}
+
+static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_parser_t *p, mpc_fold_t f, mpc_input_t *i) {
+  mpc_val_t *x = mpc_parse_fold(i, p, f, n, (mpc_val_t**)(&s->results[s->results_num-n]));
+  mpc_stack_popr_n(s, n);
+  return x;
+}
+
+static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
+  mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
+  mpc_stack_popr_n(s, n);
+  return x;
+}
+
+/*
+** Spans
+**
+** Repeating a single character parser and folding
+** the results with `mpcf_strfold` is how almost
+** every token is made. Parsing those one character
+** at a time means a tiny allocation per character
+** and then copying them all back together.
+**
+** Instead, for strings and mapped files, such
+** repeats just match characters without making
+** outputs, then copy the matched span at once.
+*/
+
+static mpc_parser_t *mpc_span_parser(mpc_input_t *i, mpc_parser_t *p) {
+  
+  mpc_parser_t *x = p->data.repeat.x;
+  
+  if (i->type != MPC_INPUT_STRING && i->type != MPC_INPUT_MMAP) { return NULL; }
+  if (p->data.repeat.f != mpcf_strfold) { return NULL; }
+  if (x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
+  
+  switch (x->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY: return x;
+    default: return NULL;
+  }
+}
+
+static int mpc_span_match(mpc_input_t *i, mpc_parser_t *x) {
+  switch (x->type) {
+    case MPC_TYPE_ANY:     return mpc_input_any(i, NULL);
+    case MPC_TYPE_SINGLE:  return mpc_input_char(i, x->data.single.x, NULL);
+    case MPC_TYPE_RANGE:   return mpc_input_range(i, x->data.range.x, x->data.range.y, NULL);
+    case MPC_TYPE_ONEOF:   return mpc_input_oneof(i, x->data.string.x, NULL);
+    case MPC_TYPE_NONEOF:  return mpc_input_noneof(i, x->data.string.x, NULL);
+    case MPC_TYPE_SATISFY: return mpc_input_satisfy(i, x->data.satisfy.f, NULL);
+    default: return 0;
+  }
+}
+
+/*
+** Match the span for the repeat `p` using the
+** character parser `x`. Returns the number of
+** characters matched, with the span copied into
+** `o` and the error that stopped it in `e`, just
+** as parsing them one at a time would have. If
+** `o` is NULL no copy is made and if `e` is NULL
+** no error is made.
+*/
+
+static int mpc_span(mpc_input_t *i, mpc_parser_t *p, mpc_parser_t *x, char **o, mpc_err_t **e) {
+  
+  int start = i->state.pos;
+  int n;
+  
+  while (mpc_span_match(i, x));
+  
+  n = i->state.pos - start;
+  if (o) {
+    *o = malloc(n + 1);
+    memcpy(*o, i->string + start, n);
+    (*o)[n] = '\0';
+  }
+  
+  if (e == NULL) {
+    return n;
+  } else if (p->data.repeat.x->type == MPC_TYPE_EXPECT) {
+    *e = mpc_err_new(i->filename, i->state, p->data.repeat.x->data.expect.m);
+  } else {
+    *e = mpc_err_fail(i->filename, i->state, "Incorrect Input");
+  }
+  
+  return n;
+}
+
+/*
+** Regex DFAs
+**
+** A regex made by `mpc_re` is a graph of
+** combinators, so every character it matches
+** goes through the parser stack. When the regex
+** is just characters, ranges, `.`, `?`, `*`, `+`
+** and `|` it is also compiled into a DFA with a
+** table of 256 transitions per state, which
+** matches strings and mapped files in one loop.
+**
+** The combinators never backtrack into a repeat
+** or into an earlier alternative, so the DFA only
+** follows characters for which there is just one
+** way to go. Then its longest match is exactly
+** what the combinators match. Characters with more
+** than one way to go bail out to the combinators.
+**
+** Only lazy parses use the DFA, as they make no
+** errors. Other parses are either of input the DFA
+** can't read or are run again to build the errors
+** of a failed parse (see `mpc_parse_lazy`), and
+** they run the combinators to build them as usual.
+*/
+
+#define MPC_DFA_STATES_MAX 1024
+
+#define MPC_DFA_DEAD -1
+#define MPC_DFA_BAIL -2
+
+enum {
+  MPC_NFA_EDGE  = 0,
+  MPC_NFA_SPLIT = 1,
+  MPC_NFA_MATCH = 2
+};
+
+typedef struct {
+  int type;
+  int out;
+  int alt;
+  mpc_parser_t *p;
+} mpc_nfa_node_t;
+
+typedef struct {
+  int nodes_num;
+  mpc_nfa_node_t *nodes;
+  int **items;
+  int *items_num;
+} mpc_nfa_t;
+
+struct mpc_dfa_t {
+  int states_num;
+  int *trans;
+  char *accept;
+};
+
+static int mpc_nfa_node(mpc_nfa_t *n, int type, mpc_parser_t *p, int out, int alt) {
+  
+  mpc_nfa_node_t *x;
+  
+  n->nodes = realloc(n->nodes, sizeof(mpc_nfa_node_t) * (n->nodes_num+1));
+  x = &n->nodes[n->nodes_num];
+  x->type = type;
+  x->out = out;
+  x->alt = alt;
+  x->p = p;
+  
+  return n->nodes_num++;
+}
+
+static int mpc_nfa_nullable(mpc_parser_t *p) {
+  
+  int i;
+  
+  switch (p->type) {
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:   return 1;
+    case MPC_TYPE_EXPECT: return mpc_nfa_nullable(p->data.expect.x);
+    case MPC_TYPE_MANY1:  return mpc_nfa_nullable(p->data.repeat.x);
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) {
+        if (mpc_nfa_nullable(p->data.or.xs[i])) { return 1; }
+      }
+      return 0;
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) {
+        if (!mpc_nfa_nullable(p->data.and.xs[i])) { return 0; }
+      }
+      return 1;
+    default: return 0;
+  }
+}
+
+/*
+** The last alternative tried by an `or`. Any
+** after one that can match nothing are never tried.
+*/
+
+static int mpc_nfa_or_last(mpc_parser_t *p) {
+  int last = 0;
+  while (last < p->data.or.n-1 && !mpc_nfa_nullable(p->data.or.xs[last])) { last++; }
+  return last;
+}
+
+/*
+** Builds the NFA for `p` in front of the node
+** `next`, returning its first node or -1 if `p`
+** can't be compiled. The first repetition of a `+`
+** is built in front of the rest like any other part.
+*/
+
+static int mpc_nfa_build(mpc_nfa_t *n, mpc_parser_t *p, int next) {
+  
+  int i, j, x, last;
+  
+  if (next < 0 || p->retained) { return -1; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      return mpc_nfa_node(n, MPC_NFA_EDGE, p, next, -1);
+    
+    case MPC_TYPE_LIFT:
+      return p->data.lift.lf == mpcf_ctor_str ? next : -1;
+    
+    case MPC_TYPE_EXPECT:
+      return mpc_nfa_build(n, p->data.expect.x, next);
+    
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return -1; }
+      x = mpc_nfa_build(n, p->data.not.x, next);
+      return x < 0 ? -1 : mpc_nfa_node(n, MPC_NFA_SPLIT, NULL, x, next);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return -1; }
+      if (mpc_nfa_nullable(p->data.repeat.x)) { return -1; }
+      j = mpc_nfa_node(n, MPC_NFA_SPLIT, NULL, -1, next);
+      x = mpc_nfa_build(n, p->data.repeat.x, j);
+      if (x < 0) { return -1; }
+      n->nodes[j].out = x;
+      if (p->type == MPC_TYPE_MANY) { return j; }
+      return mpc_nfa_build(n, p->data.repeat.x, j);
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold || p->data.and.n == 0) { return -1; }
+      for (i = p->data.and.n-1; i >= 0; i--) {
+        next = mpc_nfa_build(n, p->data.and.xs[i], next);
+      }
+      return next;
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return -1; }
+      last = mpc_nfa_or_last(p);
+      x = mpc_nfa_build(n, p->data.or.xs[last], next);
+      for (i = last-1; i >= 0 && x >= 0; i--) {
+        j = mpc_nfa_build(n, p->data.or.xs[i], next);
+        x = j < 0 ? -1 : mpc_nfa_node(n, MPC_NFA_SPLIT, NULL, j, x);
+      }
+      return x;
+    
+    default: return -1;
+  }
+  
+}
+
+static void mpc_nfa_closure(mpc_nfa_t *n, int x, int *items, int *num, char *seen) {
+  
+  mpc_nfa_node_t *a = &n->nodes[x];
+  
+  if (seen[x]) { return; }
+  seen[x] = 1;
+  
+  if (a->type == MPC_NFA_SPLIT) {
+    mpc_nfa_closure(n, a->out, items, num, seen);
+    mpc_nfa_closure(n, a->alt, items, num, seen);
+  } else {
+    items[(*num)++] = x;
+  }
+  
+}
+
+static int mpc_nfa_edge_match(mpc_parser_t *p, char c) {
+  switch (p->type) {
+    case MPC_TYPE_ANY:    return 1;
+    case MPC_TYPE_SINGLE: return c == p->data.single.x;
+    case MPC_TYPE_RANGE:  return c >= p->data.range.x && c <= p->data.range.y;
+    case MPC_TYPE_ONEOF:  return mpc_input_in(p->data.string.x, c);
+    case MPC_TYPE_NONEOF: return !mpc_input_in(p->data.string.x, c);
+    default: return 0;
+  }
+}
+
+static int mpc_dfa_state(mpc_dfa_t *d, mpc_nfa_t *n, int *items, int num) {
+  
+  int s;
+  
+  for (s = 0; s < d->states_num; s++) {
+    if (n->items_num[s] == num && memcmp(n->items[s], items, sizeof(int) * num) == 0) { return s; }
+  }
+  
+  if (d->states_num == MPC_DFA_STATES_MAX) { return -1; }
+  
+  d->states_num++;
+  n->items = realloc(n->items, sizeof(int*) * d->states_num);
+  n->items_num = realloc(n->items_num, sizeof(int) * d->states_num);
+  n->items[s] = malloc(sizeof(int) * num);
+  n->items_num[s] = num;
+  memcpy(n->items[s], items, sizeof(int) * num);
+  
+  d->trans = realloc(d->trans, sizeof(int) * 256 * d->states_num);
+  d->accept = realloc(d->accept, d->states_num);
+  
+  return s;
+}
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  free(d->trans);
+  free(d->accept);
+  free(d);
+}
+
+/*
+** Each state is the ordered list of NFA edges the
+** combinators would try from there, with the match
+** last if there is one.
+*/
+
+static int mpc_dfa_build_state(mpc_dfa_t *d, mpc_nfa_t *n, int s, int *list, char *seen) {
+  
+  int b, k, e, t, num, edges_num;
+  int items_num = n->items_num[s];
+  int *items = n->items[s];
+  
+  d->accept[s] = 0;
+  for (k = 0; k < items_num; k++) {
+    if (n->nodes[items[k]].type != MPC_NFA_MATCH) { continue; }
+    if (k != items_num-1) { return 0; }
+    d->accept[s] = 1;
+  }
+  
+  edges_num = items_num - d->accept[s];
+  
+  for (b = 0; b < 256; b++) {
+    
+    e = -1;
+    t = MPC_DFA_DEAD;
+    for (k = 0; k < edges_num; k++) {
+      if (!mpc_nfa_edge_match(n->nodes[items[k]].p, (char)b)) { continue; }
+      if (e >= 0) { t = MPC_DFA_BAIL; break; }
+      e = k;
+    }
+    
+    if (e >= 0 && t != MPC_DFA_BAIL) {
+      num = 0;
+      memset(seen, 0, n->nodes_num);
+      mpc_nfa_closure(n, n->nodes[items[e]].out, list, &num, seen);
+      t = mpc_dfa_state(d, n, list, num);
+      if (t < 0) { return 0; }
+    }
+    
+    d->trans[s * 256 + b] = t;
+  }
+  
+  return 1;
+}
+
+static mpc_dfa_t *mpc_dfa_new(mpc_parser_t *p) {
+  
+  mpc_nfa_t n;
+  mpc_dfa_t *d;
+  int s, num, start, match, success;
+  int *list;
+  char *seen;
+  
+  n.nodes_num = 0;
+  n.nodes = NULL;
+  n.items = NULL;
+  n.items_num = NULL;
+  
+  match = mpc_nfa_node(&n, MPC_NFA_MATCH, NULL, -1, -1);
+  start = mpc_nfa_build(&n, p, match);
+  if (start < 0) {
+    free(n.nodes);
+    return NULL;
+  }
+  
+  d = malloc(sizeof(mpc_dfa_t));
+  d->states_num = 0;
+  d->trans = NULL;
+  d->accept = NULL;
+  
+  list = malloc(sizeof(int) * n.nodes_num);
+  seen = calloc(n.nodes_num, 1);
+  
+  num = 0;
+  mpc_nfa_closure(&n, start, list, &num, seen);
+  mpc_dfa_state(d, &n, list, num);
+  
+  success = 1;
+  for (s = 0; s < d->states_num && success; s++) {
+    success = mpc_dfa_build_state(d, &n, s, list, seen);
+  }
+  
+  for (s = 0; s < d->states_num; s++) { free(n.items[s]); }
+  
+  free(n.items);
+  free(n.items_num);
+  free(n.nodes);
+  free(list);
+  free(seen);
+  
+  if (!success) {
+    mpc_dfa_delete(d);
+    return NULL;
+  }
+  
+  return d;
+}
+
+/*
+** Runs the DFA from the current position. On a
+** match the input moves past it and the matched
+** text goes in `o` unless it is NULL.
+*/
+
+static int mpc_dfa_match(mpc_input_t *i, mpc_dfa_t *d, char **o) {
+  
+  const unsigned char *s = (const unsigned char*)i->string;
+  mpc_state_t cur = i->state;
+  mpc_state_t end = i->state;
+  int x = 0, n;
+  int matched = d->accept[0];
+  
+  while (cur.pos < i->length) {
+    
+    x = d->trans[x * 256 + s[cur.pos]];
+    if (x == MPC_DFA_BAIL) { return 0; }
+    if (x == MPC_DFA_DEAD) { break; }
+    
+    cur.pos++;
+    cur.col++;
+    if (s[cur.pos-1] == '\n') {
+      cur.col = 0;
+      cur.row++;
+    }
+    
+    if (d->accept[x]) {
+      end = cur;
+      matched = 1;
+    }
+  }
+  
+  if (!matched) { return 0; }
+  
+  n = end.pos - i->state.pos;
+  if (o) {
+    *o = malloc(n + 1);
+    memcpy(*o, i->string + i->state.pos, n);
+    (*o)[n] = '\0';
+  }
+  
+  end.next = end.pos < i->length ? i->string[end.pos] : '\0';
+  i->state = end;
+  
+  return 1;
+}
+
+/*
+** First Sets
+**
+** Each `or` in a grammar built by `mpca_lang` gets
+** a table giving, for every character, which of its
+** alternatives might start with it. The others can
+** only fail there without consuming anything, so on
+** string input they aren't tried at all.
+**
+** The first set of a parser comes from its structure.
+** Anything unclear, such as a function or a parser
+** still being worked out further up, is assumed to
+** start with any character or with nothing at all.
+*/
+
+#define MPC_FIRST_MAX 32
+
+typedef struct {
+  unsigned char chars[32];
+  int nullable;
+} mpc_first_t;
+
+typedef struct {
+  int num;
+  mpc_parser_t **ps;
+  mpc_first_t *fs;
+  char *done;
+  int walked_num;
+  mpc_parser_t **walked;
+} mpc_first_st_t;
+
+static void mpc_first_add(mpc_first_t *f, int b) {
+  f->chars[b / 8] |= 1 << (b % 8);
+}
+
+static void mpc_first(mpc_first_st_t *s, mpc_parser_t *p, mpc_first_t *f) {
+  
+  int i, k = -1;
+  mpc_first_t g;
+  
+  memset(f, 0, sizeof(mpc_first_t));
+  
+  if (p->retained) {
+    for (k = 0; k < s->num; k++) {
+      if (s->ps[k] != p) { continue; }
+      if (s->done[k]) { *f = s->fs[k]; }
+      else { memset(f->chars, 0xFF, sizeof(f->chars)); f->nullable = 1; }
+      return;
+    }
+    s->num++;
+    s->ps = realloc(s->ps, sizeof(mpc_parser_t*) * s->num);
+    s->fs = realloc(s->fs, sizeof(mpc_first_t) * s->num);
+    s->done = realloc(s->done, s->num);
+    s->ps[k] = p;
+    s->done[k] = 0;
+  }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: break;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+      f->nullable = 1;
+      break;
+    
+    case MPC_TYPE_ANY: memset(f->chars, 0xFF, sizeof(f->chars)); break;
+    case MPC_TYPE_SINGLE: mpc_first_add(f, (unsigned char)p->data.single.x); break;
+    
+    case MPC_TYPE_RANGE:
+      for (i = 0; i < 256; i++) {
+        if ((char)i >= p->data.range.x && (char)i <= p->data.range.y) { mpc_first_add(f, i); }
+      }
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (i = 0; i < 256; i++) {
+        if (mpc_input_in(p->data.string.x, (char)i) == (p->type == MPC_TYPE_ONEOF)) { mpc_first_add(f, i); }
+      }
+      break;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0]) { mpc_first_add(f, (unsigned char)p->data.string.x[0]); }
+      else { f->nullable = 1; }
+      break;
+    
+    case MPC_TYPE_EXPECT:   mpc_first(s, p->data.expect.x, f);   break;
+    case MPC_TYPE_APPLY:    mpc_first(s, p->data.apply.x, f);    break;
+    case MPC_TYPE_APPLY_TO: mpc_first(s, p->data.apply_to.x, f); break;
+    case MPC_TYPE_PREDICT:  mpc_first(s, p->data.predict.x, f);  break;
+    case MPC_TYPE_DFA:      mpc_first(s, p->data.dfa.x, f);      break;
+    
+    case MPC_TYPE_MAYBE:
+      mpc_first(s, p->data.not.x, f);
+      f->nullable = 1;
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_first(s, p->data.repeat.x, f);
+      f->nullable = f->nullable || p->type == MPC_TYPE_MANY
+        || (p->type == MPC_TYPE_COUNT && p->data.repeat.n <= 0);
+      break;
+    
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) {
+        mpc_first(s, p->data.or.xs[i], &g);
+        for (k = 0; k < 32; k++) { f->chars[k] |= g.chars[k]; }
+        f->nullable = f->nullable || g.nullable;
+      }
+      break;
+    
+    case MPC_TYPE_AND:
+      f->nullable = 1;
+      for (i = 0; i < p->data.and.n && f->nullable; i++) {
+        mpc_first(s, p->data.and.xs[i], &g);
+        for (k = 0; k < 32; k++) { f->chars[k] |= g.chars[k]; }
+        f->nullable = g.nullable;
+      }
+      break;
+    
+    default:
+      memset(f->chars, 0xFF, sizeof(f->chars));
+      f->nullable = 1;
+      break;
+  }
+  
+  if (p->retained) {
+    for (k = 0; s->ps[k] != p; k++);
+    s->fs[k] = *f;
+    s->done[k] = 1;
+  }
+  
+}
+
+static void mpc_first_table(mpc_first_st_t *s, mpc_parser_t *p) {
+  
+  int i, b, useful = 0;
+  unsigned long *t;
+  mpc_first_t f;
+  
+  free(p->data.or.first);
+  p->data.or.first = NULL;
+  
+  if (p->data.or.n < 2 || p->data.or.n > MPC_FIRST_MAX) { return; }
+  
+  t = calloc(256, sizeof(unsigned long));
+  for (i = 0; i < p->data.or.n; i++) {
+    mpc_first(s, p->data.or.xs[i], &f);
+    for (b = 0; b < 256; b++) {
+      if (f.nullable || f.chars[b / 8] & (1 << (b % 8))) { t[b] |= 1UL << i; }
+      else { useful = 1; }
+    }
   }
+  
+  if (useful) { p->data.or.first = t; } else { free(t); }
 }
 
-static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    dx(x.output);
-    n--;
+static void mpc_first_walk(mpc_first_st_t *s, mpc_parser_t *p) {
+  
+  int i;
+  
+  if (p->retained) {
+    for (i = 0; i < s->walked_num; i++) {
+      if (s->walked[i] == p) { return; }
+    }
+    s->walked_num++;
+    s->walked = realloc(s->walked, sizeof(mpc_parser_t*) * s->walked_num);
+    s->walked[s->walked_num-1] = p;
+  }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT:   mpc_first_walk(s, p->data.expect.x);   break;
+    case MPC_TYPE_APPLY:    mpc_first_walk(s, p->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO: mpc_first_walk(s, p->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  mpc_first_walk(s, p->data.predict.x);  break;
+    case MPC_TYPE_DFA:      mpc_first_walk(s, p->data.dfa.x);      break;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      mpc_first_walk(s, p->data.not.x);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_first_walk(s, p->data.repeat.x);
+      break;
+    
+    case MPC_TYPE_OR:
+      mpc_first_table(s, p);
+      for (i = 0; i < p->data.or.n; i++) { mpc_first_walk(s, p->data.or.xs[i]); }
+      break;
+    
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) { mpc_first_walk(s, p->data.and.xs[i]); }
+      break;
+    
+    default: break;
   }
+  
 }
 
-static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    n--;
+static void mpc_first_build(int n, mpc_parser_t **ps) {
+  
+  int i;
+  mpc_first_st_t s;
+  
+  s.num = 0;
+  s.ps = NULL;
+  s.fs = NULL;
+  s.done = NULL;
+  s.walked_num = 0;
+  s.walked = NULL;
+  
+  for (i = 0; i < n; i++) {
+    if (ps[i]) { mpc_first_walk(&s, ps[i]); }
   }
+  
+  free(s.ps);
+  free(s.fs);
+  free(s.done);
+  free(s.walked);
 }
 
-static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
-  mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
-  mpc_stack_popr_n(s, n);
-  return x;
+/*
+** Packrat Memo
+**
+** In packrat mode the input is first only
+** recognised, remembering the result of every
+** combinator for each position it is tried at.
+** When it is tried at that position again the
+** end state is replayed rather than the input
+** being parsed again, so nothing is parsed twice.
+**
+** Outputs are then made in a second run which
+** skips every combinator known to fail where it
+** is tried. All the rest succeed and are kept,
+** so each output is only made once, and never
+** has to be copied or shared.
+**
+** Entries are only made while backtracking is
+** enabled, as otherwise a failure may already
+** have consumed some input.
+*/
+
+typedef struct {
+  mpc_parser_t *p;
+  int pos;
+  int success;
+  mpc_state_t state;
+  mpc_err_t *error;
+} mpc_memo_entry_t;
+
+typedef struct {
+  mpc_parser_t *p;
+  int pos;
+  int depth;
+} mpc_memo_pending_t;
+
+typedef struct {
+  
+  int entries_num;
+  int entries_slots;
+  mpc_memo_entry_t *entries;
+  
+  int pending_num;
+  int pending_slots;
+  mpc_memo_pending_t *pending;
+  
+} mpc_memo_t;
+
+static mpc_memo_t *mpc_memo_new(void) {
+  mpc_memo_t *m = malloc(sizeof(mpc_memo_t));
+  m->entries_num = 0;
+  m->entries_slots = 256;
+  m->entries = calloc(m->entries_slots, sizeof(mpc_memo_entry_t));
+  m->pending_num = 0;
+  m->pending_slots = 0;
+  m->pending = NULL;
+  return m;
 }
 
-static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
-  mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
-  mpc_stack_popr_n(s, n);
-  return x;
+static void mpc_memo_delete(mpc_memo_t *m) {
+  
+  int i;
+  for (i = 0; i < m->entries_slots; i++) {
+    if (m->entries[i].p == NULL) { continue; }
+    mpc_err_delete(m->entries[i].error);
+  }
+  
+  free(m->entries);
+  free(m->pending);
+  free(m);
+}
+
+/* Characters are parsed no slower than an entry is found, so only combinators are remembered */
+
+static int mpc_memo_type(mpc_parser_t *p) {
+  return (p->type == MPC_TYPE_EXPECT || p->type >= MPC_TYPE_APPLY) && p->type != MPC_TYPE_PREDICT;
+}
+
+static mpc_memo_entry_t *mpc_memo_find(mpc_memo_entry_t *entries, int slots, mpc_parser_t *p, int pos) {
+  
+  unsigned long h = ((unsigned long)p >> 4) * 31 + (unsigned long)pos * 2654435761u;
+  unsigned long j = h & (slots-1);
+  
+  while (entries[j].p != NULL && (entries[j].p != p || entries[j].pos != pos)) {
+    j = (j+1) & (slots-1);
+  }
+  
+  return &entries[j];
+}
+
+static void mpc_memo_grow(mpc_memo_t *m) {
+  
+  int i;
+  int slots = m->entries_slots * 2;
+  mpc_memo_entry_t *entries = calloc(slots, sizeof(mpc_memo_entry_t));
+  
+  for (i = 0; i < m->entries_slots; i++) {
+    if (m->entries[i].p == NULL) { continue; }
+    *mpc_memo_find(entries, slots, m->entries[i].p, m->entries[i].pos) = m->entries[i];
+  }
+  
+  free(m->entries);
+  m->entries = entries;
+  m->entries_slots = slots;
+}
+
+static void mpc_memo_push(mpc_memo_t *m, mpc_parser_t *p, int pos, int depth) {
+  
+  if (m->pending_num == m->pending_slots) {
+    m->pending_slots = m->pending_slots ? m->pending_slots * 2 : 64;
+    m->pending = realloc(m->pending, sizeof(mpc_memo_pending_t) * m->pending_slots);
+  }
+  
+  m->pending[m->pending_num].p = p;
+  m->pending[m->pending_num].pos = pos;
+  m->pending[m->pending_num].depth = depth;
+  m->pending_num++;
+}
+
+/*
+** Called whenever a parser has finished and its
+** result is on top of the result stack. If it is
+** the parser we are waiting on, remember it.
+*/
+
+static void mpc_memo_store(mpc_memo_t *m, mpc_stack_t *stk, mpc_input_t *i, mpc_parser_t *p) {
+  
+  mpc_memo_pending_t *t;
+  mpc_memo_entry_t *e;
+  mpc_result_t r;
+  int success;
+  
+  if (m->pending_num == 0) { return; }
+  
+  t = &m->pending[m->pending_num-1];
+  if (t->p != p || t->depth != stk->parsers_num) { return; }
+  m->pending_num--;
+  
+  success = mpc_stack_peekr(stk, &r);
+  
+  if (m->entries_num * 2 >= m->entries_slots) { mpc_memo_grow(m); }
+  
+  e = mpc_memo_find(m->entries, m->entries_slots, p, t->pos);
+  e->p = p;
+  e->pos = t->pos;
+  e->success = success;
+  e->state = i->state;
+  e->error = success ? NULL : mpc_err_copy(r.error);
+  m->entries_num++;
 }
 
 /*
@@ -901,20 +2461,27 @@ static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
 */
 
 #define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
-#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
-#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
-#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
+#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); if (memo && i->recog) { mpc_memo_store(memo, stk, i, p); } continue
+#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); if (memo && i->recog) { mpc_memo_store(memo, stk, i, p); } continue
+#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(MPC_ERR(mpc_err_fail(i->filename, i->state, "Incorrect Input"))); }
+#define MPC_ERR(x) (lazy ? NULL : (x))
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final, mpc_memo_t *memo, int lazy) {
   
   /* Stack */
   int st = 0;
   mpc_parser_t *p = NULL;
-  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  mpc_stack_t *stk = mpc_stack_new(i->ctx, i->filename, lazy);
   
   /* Variables */
-  char *s;
+  int k, held;
+  unsigned long m;
+  char *s = NULL;
+  char **o = i->recog ? NULL : &s;
   mpc_result_t r;
+  mpc_memo_entry_t *e;
+  mpc_parser_t *x;
+  mpc_err_t *err = NULL;
 
   /* Go! */
   mpc_stack_pushp(stk, init);
@@ -923,27 +2490,62 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
     
     mpc_stack_peepp(stk, &p, &st);
     
+    /* Packrat: when recognising replay or start remembering, otherwise skip known failures */
+    
+    if (memo && st == 0 && mpc_memo_type(p) && i->backtrack > 0) {
+      e = mpc_memo_find(memo->entries, memo->entries_slots, p, i->state.pos);
+      if (e->p == p && !e->success) {
+        mpc_stack_popp(stk, &p, &st);
+        i->state = e->state;
+        mpc_stack_pushr(stk, mpc_result_err(mpc_err_copy(e->error)), 0);
+        continue;
+      }
+      if (e->p == p && i->recog) {
+        mpc_stack_popp(stk, &p, &st);
+        i->state = e->state;
+        mpc_stack_pushr(stk, mpc_result_out(NULL), 1);
+        continue;
+      }
+      if (i->recog) { mpc_memo_push(memo, p, i->state.pos, stk->parsers_num-1); }
+    }
+    
     switch (p->type) {
       
       /* Trivial Parsers */
 
-      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
+      case MPC_TYPE_UNDEFINED: MPC_FAILURE(MPC_ERR(mpc_err_fail(i->filename, i->state, "Parser Undefined!")));      
       case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
-      case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+      case MPC_TYPE_FAIL:      MPC_FAILURE(MPC_ERR(mpc_err_fail(i->filename, i->state, p->data.fail.m)));
+      case MPC_TYPE_LIFT:      MPC_SUCCESS(mpc_parse_lift(i, p->data.lift.lf));
+      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(i->recog ? NULL : p->data.lift.x);
     
       /* Basic Parsers */
 
       case MPC_TYPE_SOI:       MPC_PRIMATIVE(NULL, mpc_input_soi(i));
       case MPC_TYPE_EOI:       MPC_PRIMATIVE(NULL, mpc_input_eoi(i));
-      case MPC_TYPE_ANY:       MPC_PRIMATIVE(s, mpc_input_any(i, &s));
-      case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, &s));
-      case MPC_TYPE_RANGE:     MPC_PRIMATIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, &s));
-      case MPC_TYPE_ONEOF:     MPC_PRIMATIVE(s, mpc_input_oneof(i, p->data.string.x, &s));
-      case MPC_TYPE_NONEOF:    MPC_PRIMATIVE(s, mpc_input_noneof(i, p->data.string.x, &s));
-      case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
-      case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, &s));
+      case MPC_TYPE_ANY:       MPC_PRIMATIVE(s, mpc_input_any(i, o));
+      case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, o));
+      case MPC_TYPE_RANGE:     MPC_PRIMATIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, o));
+      case MPC_TYPE_ONEOF:     MPC_PRIMATIVE(s, mpc_input_oneof(i, p->data.string.x, o));
+      case MPC_TYPE_NONEOF:    MPC_PRIMATIVE(s, mpc_input_noneof(i, p->data.string.x, o));
+      case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, o));
+      case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, o));
+      
+      /* Regex Parsers */
+      
+      case MPC_TYPE_DFA:
+        if (st == 0 && lazy && (i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP)
+        &&  mpc_dfa_match(i, p->data.dfa.d, o)) {
+          MPC_SUCCESS(s);
+        }
+        if (st == 0) { MPC_CONTINUE(1, p->data.dfa.x); }
+        if (st == 1) {
+          if (mpc_stack_popr(stk, &r)) {
+            MPC_SUCCESS(r.output);
+          } else {
+            MPC_FAILURE(r.error);
+          }
+        }
     
       /* Application Parsers */
       
@@ -954,7 +2556,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             MPC_SUCCESS(r.output);
           } else {
             mpc_err_delete(r.error); 
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.expect.m));
+            MPC_FAILURE(MPC_ERR(mpc_err_new(i->filename, i->state, p->data.expect.m)));
           }
         }
       
@@ -962,7 +2564,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 0) { MPC_CONTINUE(1, p->data.apply.x); }
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
-            MPC_SUCCESS(p->data.apply.f(r.output));
+            MPC_SUCCESS(mpc_parse_apply(i, p, r.output));
           } else {
             MPC_FAILURE(r.error);
           }
@@ -972,7 +2574,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 0) { MPC_CONTINUE(1, p->data.apply_to.x); }
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
-            MPC_SUCCESS(p->data.apply_to.f(r.output, p->data.apply_to.d));
+            MPC_SUCCESS(mpc_parse_apply_to(i, p, r.output));
           } else {
             MPC_FAILURE(r.error);
           }
@@ -995,12 +2597,12 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
             mpc_input_rewind(i);
-            p->data.not.dx(r.output);
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite"));
+            mpc_parse_dtor(i, p, p->data.not.dx, r.output);
+            MPC_FAILURE(MPC_ERR(mpc_err_new(i->filename, i->state, "opposite")));
           } else {
             mpc_input_unmark(i);
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
           }
         }
       
@@ -1011,13 +2613,18 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             MPC_SUCCESS(r.output);
           } else {
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
           }
         }
       
       /* Repeat Parsers */
       
       case MPC_TYPE_MANY:
+        if (st == 0 && (x = mpc_span_parser(i, p))) {
+          mpc_span(i, p, x, o, lazy ? NULL : &err);
+          mpc_stack_err(stk, err);
+          MPC_SUCCESS(s);
+        }
         if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
@@ -1025,11 +2632,20 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           } else {
             mpc_stack_popr(stk, &r);
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+            MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p, p->data.repeat.f, i));
           }
         }
       
       case MPC_TYPE_MANY1:
+        if (st == 0 && (x = mpc_span_parser(i, p))) {
+          if (mpc_span(i, p, x, o, lazy ? NULL : &err) == 0) {
+            free(s);
+            s = NULL;
+            MPC_FAILURE(mpc_err_many1(err));
+          }
+          mpc_stack_err(stk, err);
+          MPC_SUCCESS(s);
+        }
         if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
@@ -1041,7 +2657,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
-              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p, p->data.repeat.f, i));
             }
           }
         }
@@ -1054,14 +2670,14 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           } else {
             if (st != (p->data.repeat.n+1)) {
               mpc_stack_popr(stk, &r);
-              mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
+              mpc_stack_popr_out_single(stk, st-1, p, i);
               mpc_input_rewind(i);
               MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
               mpc_input_unmark(i);
-              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p, p->data.repeat.f, i));
             }
           }
         }
@@ -1072,6 +2688,28 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         
         if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
         
+        /* With a first set table the state is negative, holding the alternative and the errors so far */
+        
+        if (st == 0 && lazy && p->data.or.first && !mpc_input_terminated(i)) {
+          m = p->data.or.first[(unsigned char)i->string[i->state.pos]];
+          if (m == 0) { MPC_FAILURE(NULL); }
+          for (k = 0; !(m & (1UL << k)); k++);
+          MPC_CONTINUE(-1-k, p->data.or.xs[k]);
+        }
+        if (st < 0) {
+          k = (-1-st) % MPC_FIRST_MAX;
+          held = (-1-st) / MPC_FIRST_MAX;
+          if (mpc_stack_peekr(stk, &r)) {
+            mpc_stack_popr(stk, &r);
+            mpc_stack_popr_err(stk, held);
+            MPC_SUCCESS(r.output);
+          }
+          m = p->data.or.first[(unsigned char)i->string[i->state.pos]] & ~((2UL << k) - 1);
+          if (m == 0) { MPC_FAILURE(mpc_stack_merger_err(stk, held+1)); }
+          for (k = 0; !(m & (1UL << k)); k++);
+          MPC_CONTINUE(-1 - k - MPC_FIRST_MAX * (held+1), p->data.or.xs[k]);
+        }
+        
         if (st == 0) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
         if (st <= p->data.or.n) {
           if (mpc_stack_peekr(stk, &r)) {
@@ -1085,29 +2723,29 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       
       case MPC_TYPE_AND:
         
-        if (p->data.or.n == 0) { MPC_SUCCESS(p->data.and.f(0, NULL)); }
+        if (p->data.or.n == 0) { MPC_SUCCESS(mpc_parse_fold(i, p, p->data.and.f, 0, NULL)); }
         
         if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, p->data.and.xs[st]); }
         if (st <= p->data.and.n) {
           if (!mpc_stack_peekr(stk, &r)) {
             mpc_input_rewind(i);
             mpc_stack_popr(stk, &r);
-            mpc_stack_popr_out(stk, st-1, p->data.and.dxs);
+            mpc_stack_popr_out(stk, st-1, p, i);
             MPC_FAILURE(r.error);
           }
           if (st <  p->data.and.n) { MPC_CONTINUE(st+1, p->data.and.xs[st]); }
-          if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, p->data.and.f)); }
+          if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, p, p->data.and.f, i)); }
         }
       
       /* End */
       
       default:
         
-        MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!"));
+        MPC_FAILURE(MPC_ERR(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!")));
     }
   }
   
-  return mpc_stack_terminate(stk, final);
+  return mpc_stack_terminate(i->ctx, stk, final);
   
 }
 
@@ -1115,18 +2753,152 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMATIVE
+#undef MPC_ERR
+
+/*
+** On string input parsing is first run lazily.
+** No errors are made at all, since on success
+** they are all thrown away, and the first set
+** tables are used to skip alternatives. Only if
+** parsing fails is it run again from the start,
+** making errors as it goes, to give the full
+** message. Other inputs can't be rewound so make
+** errors eagerly.
+**
+** The second run only recognises the input. No
+** outputs are made and no apply, fold, lift or
+** destructor functions are called, so each of
+** them is called just once per parse. They never
+** decide whether parsing succeeds so the second
+** run fails just where the first did.
+*/
+
+static int mpc_parse_lazy(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  
+  int x;
+  mpc_state_t s = i->state;
+  int lazy = i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP;
+  
+  x = mpc_parse_run(i, init, final, NULL, lazy);
+  
+  if (!x && lazy) {
+    mpc_err_delete(final->error);
+    i->state = s;
+    i->recog = 1;
+    x = mpc_parse_run(i, init, final, NULL, 0);
+    i->recog = 0;
+  }
+  
+  return x;
+}
+
+/*
+** Packrat parsing first recognises the input
+** lazily, filling in the memo. On success the
+** outputs are made by running again with it, and
+** on failure the errors by recognising again
+** with a new one, so the errors remembered are
+** the full ones.
+*/
+
+static int mpc_parse_packrat_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  
+  int x;
+  mpc_state_t s = i->state;
+  mpc_memo_t *m = mpc_memo_new();
+  
+  i->recog = 1;
+  x = mpc_parse_run(i, init, final, m, 1);
+  i->state = s;
+  
+  if (x) {
+    i->recog = 0;
+    x = mpc_parse_run(i, init, final, m, 1);
+  } else {
+    mpc_err_delete(final->error);
+    mpc_memo_delete(m);
+    m = mpc_memo_new();
+    x = mpc_parse_run(i, init, final, m, 0);
+    i->recog = 0;
+  }
+  
+  mpc_memo_delete(m);
+  return x;
+}
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  return mpc_parse_lazy(i, init, final);
+}
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
+  mpc_input_t *i = mpc_input_new_string(NULL, filename, string, strlen(string));
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+/*
+** Like `mpc_parse` but for the `length` bytes at
+** `buffer`, which need not end in NUL and may
+** contain it.
+*/
+
+int mpc_parse_buffer(const char *filename, const char *buffer, int length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(NULL, filename, buffer, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+/*
+** Like `mpc_parse` but with the AST put in the
+** arena `a`. Nothing is left in it on failure.
+*/
+
+int mpc_parse_arena(const char *filename, const char *string, mpc_parser_t *p, mpc_arena_t *a, mpc_result_t *r) {
+  return mpc_parse_context(NULL, filename, string, strlen(string), p, a, r);
+}
+
+/*
+** Like `mpc_parse_buffer` but using the context `c`,
+** so threads each with their own context can parse
+** with the same parser without ever waiting on one
+** another. The arena `a` may be NULL, and so may
+** `c` to borrow a context as the others do.
+*/
+
+int mpc_parse_context(mpc_context_t *c, const char *filename, const char *buffer, int length, mpc_parser_t *p, mpc_arena_t *a, mpc_result_t *r) {
+  int x;
+  mpc_arena_mark_t m;
+  mpc_input_t *i = mpc_input_new_string(c, filename, buffer, length);
+  if (a) { m = mpc_arena_mark(a); }
+  i->arena = a;
   x = mpc_parse_input(i, p, r);
+  if (!x && a) { mpc_arena_rewind(a, m); }
+  mpc_input_delete(i);
+  return x;
+}
+
+/*
+** Like `mpc_parse` but in packrat mode, which
+** takes time linear in the length of the input
+** however much the grammar backtracks, at the
+** cost of memory for the memo.
+*/
+
+int mpc_parse_packrat(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(NULL, filename, string, strlen(string));
+  x = mpc_parse_packrat_input(i, p, r);
   mpc_input_delete(i);
   return x;
 }
 
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
+  mpc_input_t *i = mpc_input_new_file(NULL, filename, file);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1134,7 +2906,7 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  mpc_input_t *i = mpc_input_new_pipe(NULL, filename, pipe);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1169,6 +2941,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.first);
   
 }
 
@@ -1220,6 +2993,11 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
     
+    case MPC_TYPE_DFA:
+      mpc_dfa_delete(p->data.dfa.d);
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      break;
+    
     default: break;
   }
   
@@ -1253,6 +3031,7 @@ static mpc_parser_t *mpc_undefined(void) {
   mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
   p->retained = 0;
   p->type = MPC_TYPE_UNDEFINED;
+  p->ast = MPC_AST_NONE;
   p->name = NULL;
   return p;
 }
@@ -1268,6 +3047,7 @@ mpc_parser_t *mpc_new(const char *name) {
 mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
   mpc_undefine_unretained(p, 1);
   p->type = MPC_TYPE_UNDEFINED;
+  p->ast = MPC_AST_NONE;
   return p;
 }
 
@@ -1275,10 +3055,12 @@ mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   
   if (p->retained) {
     p->type = a->type;
+    p->ast = a->ast;
     p->data = a->data;
   } else {
     mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
     p->type = a2->type;
+    p->ast = a2->ast;
     p->data = a2->data;
     free(a2);
   }
@@ -1561,6 +3343,7 @@ mpc_parser_t *mpc_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -1923,6 +3706,25 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** Once the regex is built, compile it into a
+** DFA if it can be. The combinators are kept to
+** report errors and to parse pipes.
+*/
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *x) {
+  
+  mpc_parser_t *p;
+  mpc_dfa_t *d = mpc_dfa_new(x);
+  if (d == NULL) { return x; }
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.d = d;
+  p->data.dfa.x = x;
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   
   char *err_msg;
@@ -1980,7 +3782,7 @@ mpc_parser_t *mpc_re(const char *re) {
   mpc_delete(RegexEnclose);
   mpc_cleanup(5, Regex, Term, Factor, Base, Range);
   
-  return r.output;
+  return mpc_re_dfa(r.output);
   
 }
 
@@ -2175,13 +3977,23 @@ mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1)
 mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-  char *x = calloc(1, 1);
+  
   int i;
+  size_t l = 0;
+  char *x;
+  
+  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+  
+  x = malloc(l + 1);
+  l = 0;
   for (i = 0; i < n; i++) {
-    x = realloc(x, strlen(x) + strlen(xs[i]) + 1);
-    strcat(x, xs[i]);
+    size_t m = strlen(xs[i]);
+    memcpy(x + l, xs[i], m);
+    l += m;
     free(xs[i]);
   }
+  x[l] = '\0';
+  
   return x;
 }
 
@@ -2297,6 +4109,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
   if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
   
+  if (p->type == MPC_TYPE_DFA) { mpc_print_unretained(p->data.dfa.x, 0); }
+  
   if (p->type == MPC_TYPE_OR) {
     printf("(");
     for(i = 0; i < p->data.or.n-1; i++) {
@@ -2394,7 +4208,6 @@ void mpc_ast_delete(mpc_ast_t *a) {
   }
   
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
   
@@ -2402,7 +4215,6 @@ void mpc_ast_delete(mpc_ast_t *a) {
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
 }
@@ -2411,8 +4223,7 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
   mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
   
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  mpc_ast_set_tag(a, mpc_tag_id(tag));
   
   a->contents = malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
@@ -2458,7 +4269,7 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   
   int i;
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (a->tag_id != b->tag_id) { return 0; }
   if (strcmp(a->contents, b->contents) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
   
@@ -2478,16 +4289,12 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  mpc_ast_set_tag(a, mpc_tag_add(t, a->tag_id));
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
+  mpc_ast_set_tag(a, mpc_tag_id(t));
   return a;
 }
 
@@ -2557,23 +4364,34 @@ mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
   return a;
 }
 
+/* Marks `p` as applying the AST function `ast` */
+
+static mpc_parser_t *mpca_ast(mpc_parser_t *p, int ast) {
+  p->ast = ast;
+  return p;
+}
+
+static mpc_parser_t *mpca_str(mpc_parser_t *a) {
+  return mpca_ast(mpc_apply(a, mpcf_str_ast), MPC_AST_STR);
+}
+
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+  return mpca_ast(mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t), MPC_AST_TAG);
 }
 
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+  return mpca_ast(mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t), MPC_AST_ADD_TAG);
 }
 
 mpc_parser_t *mpca_root(mpc_parser_t *a) {
-  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+  return mpca_ast(mpc_apply(a, (mpc_apply_t)mpc_ast_add_root), MPC_AST_ROOT);
 }
 
-mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpca_ast(mpc_not(a, (mpc_dtor_t)mpc_ast_delete), MPC_AST_DELETE); }
 mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
-mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpca_ast(mpc_many(mpcf_fold_ast, a), MPC_AST_FOLD); }
+mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpca_ast(mpc_many1(mpcf_fold_ast, a), MPC_AST_FOLD); }
+mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpca_ast(mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete), MPC_AST_FOLD); }
 
 mpc_parser_t *mpca_or(int n, ...) {
 
@@ -2585,6 +4403,7 @@ mpc_parser_t *mpca_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -2604,6 +4423,7 @@ mpc_parser_t *mpca_and(int n, ...) {
   mpc_parser_t *p = mpc_undefined();
   
   p->type = MPC_TYPE_AND;
+  p->ast = MPC_AST_FOLD;
   p->data.and.n = n;
   p->data.and.f = mpcf_fold_ast;
   p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
@@ -2621,7 +4441,7 @@ mpc_parser_t *mpca_and(int n, ...) {
   return p;  
 }
 
-mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpca_ast(mpc_total(a, (mpc_dtor_t)mpc_ast_delete), MPC_AST_DELETE); }
 
 /*
 ** Grammar Parser
@@ -2706,7 +4526,7 @@ static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPC_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
   free(y);
-  return mpca_tag(mpc_apply(p, mpcf_str_ast), "string");
+  return mpca_tag(mpca_str(p), "string");
 }
 
 static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
@@ -2714,7 +4534,7 @@ static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPC_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
   free(y);
-  return mpca_tag(mpc_apply(p, mpcf_str_ast), "char");
+  return mpca_tag(mpca_str(p), "char");
 }
 
 static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
@@ -2722,7 +4542,7 @@ static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape_regex(x);
   mpc_parser_t *p = (st->flags & MPC_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
   free(y);
-  return mpca_tag(mpc_apply(p, mpcf_str_ast), "regex");
+  return mpca_tag(mpca_str(p), "regex");
 }
 
 static int is_number(const char* s) {
@@ -2798,7 +4618,7 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
 mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
   
   char *err_msg;
-  mpc_parser_t *err_out;
+  mpc_parser_t *err_out, *out;
   mpc_result_t r;
   mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
   
@@ -2850,7 +4670,10 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
   
   mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
   
-  return (st->flags & MPC_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+  out = r.output;
+  mpc_first_build(1, &out);
+  
+  return (st->flags & MPC_LANG_PREDICTIVE) ? mpc_predictive(out) : out;
   
 }
 
@@ -2998,6 +4821,7 @@ static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
     e = r.error;
   } else {
     e = NULL;
+    mpc_first_build(st->parsers_num, st->parsers);
   }
   
   mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
@@ -3018,7 +4842,7 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_file("<mpca_lang_file>", f);
+  i = mpc_input_new_file(NULL, "<mpca_lang_file>", f);
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -3040,7 +4864,7 @@ mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
+  i = mpc_input_new_pipe(NULL, "<mpca_lang_pipe>", p);
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -3063,7 +4887,7 @@ mpc_err_t *mpca_lang(int flags, const char *language, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_string("<mpca_lang>", language);
+  i = mpc_input_new_string(NULL, "<mpca_lang>", language, strlen(language));
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -3093,7 +4917,7 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_file(filename, f);
+  i = mpc_input_new_file(NULL, filename, f);
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -3104,3 +4928,590 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   
   return err;
 }
+
+/*
+** Saving & Loading
+*/
+
+/*
+** The parsers given are saved with everything
+** they are built from, so that a program can load
+** them back in place of calling `mpca_lang` again.
+**
+** As only retained parsers can be shared every
+** other parser is saved as part of a tree. The
+** retained ones are saved as their place in the
+** list given so it must include all that can be
+** reached, and the same list is given to load.
+**
+** Functions are saved as their place in the table
+** below. Parsers using any others can't be saved,
+** and neither can those holding values or data
+** other than the tags used by `mpca_tag`.
+**
+** Which AST function a parser applies is saved
+** along with its type.
+**
+** Files start with a version, which must be bumped
+** whenever the parser types, the table or the way
+** parsers are written change. Files of any other
+** version aren't loaded.
+*/
+
+typedef void(*mpc_func_t)(void);
+
+enum {
+  MPC_FUNC_PLAIN = 0,
+  MPC_FUNC_TAG   = 1
+};
+
+typedef struct {
+  mpc_func_t f;
+  int kind;
+} mpc_func_entry_t;
+
+static const mpc_func_entry_t mpc_funcs[] = {
+  
+  { (mpc_func_t)free,                     MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpc_soft_delete,          MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpc_ast_delete,           MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_dtor_null,           MPC_FUNC_PLAIN },
+  
+  { (mpc_func_t)mpcf_ctor_null,           MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_ctor_str,            MPC_FUNC_PLAIN },
+  
+  { (mpc_func_t)mpcf_free,                MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_int,                 MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_hex,                 MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_oct,                 MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_float,               MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_escape,              MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_unescape,            MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_unescape_regex,      MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_escape_string_raw,   MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_unescape_string_raw, MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_escape_char_raw,     MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_unescape_char_raw,   MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_str_ast,             MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpc_ast_add_root,         MPC_FUNC_PLAIN },
+  
+  { (mpc_func_t)mpcf_null,                MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_fst,                 MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_snd,                 MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_trd,                 MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_fst_free,            MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_snd_free,            MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_trd_free,            MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_strfold,             MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_maths,               MPC_FUNC_PLAIN },
+  { (mpc_func_t)mpcf_fold_ast,            MPC_FUNC_PLAIN },
+  
+  { (mpc_func_t)mpc_ast_tag,              MPC_FUNC_TAG },
+  { (mpc_func_t)mpc_ast_add_tag,          MPC_FUNC_TAG }
+  
+};
+
+#define MPC_FUNCS_NUM ((int)(sizeof(mpc_funcs) / sizeof(mpc_func_entry_t)))
+
+static const char mpc_save_magic[4] = { 'm', 'p', 'c', 0 };
+
+#define MPC_SAVE_VERSION 3
+
+typedef struct {
+  FILE *f;
+  int parsers_num;
+  mpc_parser_t **parsers;
+  char *failure;
+} mpc_save_st_t;
+
+static void mpc_save_fail(mpc_save_st_t *s, const char *fmt, const char *name) {
+  if (s->failure) { return; }
+  s->failure = malloc(strlen(fmt) + strlen(name ? name : "") + 1);
+  sprintf(s->failure, fmt, name ? name : "");
+}
+
+static mpc_err_t *mpc_save_err(mpc_save_st_t *s, const char *filename) {
+  mpc_err_t *e;
+  if (s->failure == NULL && ferror(s->f)) { mpc_save_fail(s, "Unable to access file!", NULL); }
+  if (s->failure == NULL) { return NULL; }
+  e = mpc_err_fail(filename, mpc_state_new(), s->failure);
+  free(s->failure);
+  return e;
+}
+
+static void mpc_save_int(mpc_save_st_t *s, int x) {
+  unsigned long u = (unsigned long)x;
+  fputc((int)(u & 0xFF), s->f);
+  fputc((int)((u >> 8) & 0xFF), s->f);
+  fputc((int)((u >> 16) & 0xFF), s->f);
+  fputc((int)((u >> 24) & 0xFF), s->f);
+}
+
+static void mpc_save_char(mpc_save_st_t *s, char c) {
+  fputc((unsigned char)c, s->f);
+}
+
+static void mpc_save_string(mpc_save_st_t *s, const char *x) {
+  if (x == NULL) { mpc_save_int(s, -1); return; }
+  mpc_save_int(s, strlen(x));
+  fwrite(x, 1, strlen(x), s->f);
+}
+
+static void mpc_save_func(mpc_save_st_t *s, mpc_func_t f, int kind, mpc_parser_t *p) {
+  int i;
+  if (f == NULL) { mpc_save_int(s, -1); return; }
+  for (i = 0; i < MPC_FUNCS_NUM; i++) {
+    if (mpc_funcs[i].f == f && mpc_funcs[i].kind == kind) { mpc_save_int(s, i); return; }
+  }
+  mpc_save_fail(s, "Parser '%s' uses a function which can't be saved!", p->name);
+}
+
+static void mpc_save_dfa(mpc_save_st_t *s, mpc_dfa_t *d) {
+  
+  int i;
+  
+  mpc_save_int(s, d->states_num);
+  
+  for (i = 0; i < d->states_num * 256; i++) { mpc_save_int(s, d->trans[i]); }
+  for (i = 0; i < d->states_num; i++) { mpc_save_char(s, d->accept[i]); }
+  
+}
+
+static void mpc_save_parser(mpc_save_st_t *s, mpc_parser_t *p, mpc_parser_t *root) {
+  
+  int i;
+  
+  if (p->retained && p != root) {
+    for (i = 0; i < s->parsers_num; i++) {
+      if (s->parsers[i] == p) { mpc_save_int(s, -1-i); return; }
+    }
+    mpc_save_fail(s, "Parser '%s' is used but wasn't given!", p->name);
+    return;
+  }
+  
+  mpc_save_int(s, p->type);
+  mpc_save_char(s, p->ast);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: mpc_save_string(s, p->data.fail.m); break;
+    case MPC_TYPE_LIFT: mpc_save_func(s, (mpc_func_t)p->data.lift.lf, MPC_FUNC_PLAIN, root); break;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_save_parser(s, p->data.expect.x, root);
+      mpc_save_string(s, p->data.expect.m);
+      break;
+    
+    case MPC_TYPE_SINGLE:
+      mpc_save_char(s, p->data.single.x);
+      break;
+    
+    case MPC_TYPE_RANGE:
+      mpc_save_char(s, p->data.range.x);
+      mpc_save_char(s, p->data.range.y);
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      mpc_save_string(s, p->data.string.x);
+      break;
+    
+    case MPC_TYPE_APPLY:
+      mpc_save_parser(s, p->data.apply.x, root);
+      mpc_save_func(s, (mpc_func_t)p->data.apply.f, MPC_FUNC_PLAIN, root);
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      mpc_save_parser(s, p->data.apply_to.x, root);
+      mpc_save_func(s, (mpc_func_t)p->data.apply_to.f, MPC_FUNC_TAG, root);
+      mpc_save_string(s, p->data.apply_to.d);
+      break;
+    
+    case MPC_TYPE_PREDICT: mpc_save_parser(s, p->data.predict.x, root); break;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      mpc_save_parser(s, p->data.not.x, root);
+      mpc_save_func(s, (mpc_func_t)p->data.not.dx, MPC_FUNC_PLAIN, root);
+      mpc_save_func(s, (mpc_func_t)p->data.not.lf, MPC_FUNC_PLAIN, root);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_save_int(s, p->data.repeat.n);
+      mpc_save_func(s, (mpc_func_t)p->data.repeat.f, MPC_FUNC_PLAIN, root);
+      mpc_save_parser(s, p->data.repeat.x, root);
+      mpc_save_func(s, (mpc_func_t)p->data.repeat.dx, MPC_FUNC_PLAIN, root);
+      break;
+    
+    case MPC_TYPE_OR:
+      mpc_save_int(s, p->data.or.n);
+      for (i = 0; i < p->data.or.n; i++) { mpc_save_parser(s, p->data.or.xs[i], root); }
+      break;
+    
+    case MPC_TYPE_AND:
+      mpc_save_int(s, p->data.and.n);
+      mpc_save_func(s, (mpc_func_t)p->data.and.f, MPC_FUNC_PLAIN, root);
+      for (i = 0; i < p->data.and.n; i++) { mpc_save_parser(s, p->data.and.xs[i], root); }
+      for (i = 0; i < p->data.and.n-1; i++) {
+        mpc_save_func(s, (mpc_func_t)p->data.and.dxs[i], MPC_FUNC_PLAIN, root);
+      }
+      break;
+    
+    case MPC_TYPE_DFA:
+      mpc_save_parser(s, p->data.dfa.x, root);
+      mpc_save_dfa(s, p->data.dfa.d);
+      break;
+    
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_SATISFY:
+      mpc_save_fail(s, "Parser '%s' holds a value which can't be saved!", root->name);
+      break;
+    
+    default: break;
+  }
+  
+}
+
+mpc_err_t *mpc_save(FILE *f, int n, ...) {
+  
+  int i;
+  mpc_save_st_t s;
+  mpc_err_t *e;
+  va_list va;
+  
+  s.f = f;
+  s.parsers_num = n;
+  s.parsers = malloc(sizeof(mpc_parser_t*) * n);
+  s.failure = NULL;
+  
+  va_start(va, n);
+  for (i = 0; i < n; i++) { s.parsers[i] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
+  
+  fwrite(mpc_save_magic, 1, sizeof(mpc_save_magic), f);
+  mpc_save_int(&s, MPC_SAVE_VERSION);
+  mpc_save_int(&s, n);
+  for (i = 0; i < n; i++) { mpc_save_string(&s, s.parsers[i]->name); }
+  for (i = 0; i < n; i++) { mpc_save_parser(&s, s.parsers[i], s.parsers[i]); }
+  
+  e = mpc_save_err(&s, "<mpc_save>");
+  free(s.parsers);
+  return e;
+}
+
+/*
+** When loading fails half way the parsers read
+** so far are still complete trees so they can be
+** deleted, and the parsers given are left alone.
+*/
+
+static int mpc_load_int(mpc_save_st_t *s) {
+  
+  int i, c;
+  unsigned long u = 0;
+  
+  for (i = 0; i < 4; i++) {
+    c = fgetc(s->f);
+    if (c == EOF) {
+      mpc_save_fail(s, "Unexpected end of file!", NULL);
+      return 0;
+    }
+    u |= (unsigned long)c << (8 * i);
+  }
+  
+  return u >= 0x80000000UL ? -(int)(0xFFFFFFFFUL - u) - 1 : (int)u;
+}
+
+static char mpc_load_char(mpc_save_st_t *s) {
+  int c = fgetc(s->f);
+  if (c == EOF) { mpc_save_fail(s, "Unexpected end of file!", NULL); }
+  return (char)c;
+}
+
+static char *mpc_load_string(mpc_save_st_t *s) {
+  
+  char *x;
+  int n = mpc_load_int(s);
+  
+  if (n < 0 || s->failure) { n = 0; }
+  
+  x = malloc((size_t)n + 1);
+  if (fread(x, 1, n, s->f) != (size_t)n) { mpc_save_fail(s, "Unexpected end of file!", NULL); n = 0; }
+  x[n] = '\0';
+  return x;
+}
+
+static mpc_func_t mpc_load_func(mpc_save_st_t *s, int kind) {
+  
+  int i = mpc_load_int(s);
+  
+  if (i == -1 || s->failure) { return NULL; }
+  if (i < 0 || i >= MPC_FUNCS_NUM || mpc_funcs[i].kind != kind) {
+    mpc_save_fail(s, "Unknown function!", NULL);
+    return NULL;
+  }
+  
+  return mpc_funcs[i].f;
+}
+
+/*
+** Tags are the names of the parsers given
+** or else one of the tags `mpca_lang` uses.
+*/
+
+static void *mpc_load_tag(mpc_save_st_t *s) {
+  
+  static const char *tags[] = { "string", "char", "regex" };
+  int i;
+  void *t = NULL;
+  char *x = mpc_load_string(s);
+  
+  for (i = 0; i < s->parsers_num && t == NULL; i++) {
+    if (s->parsers[i]->name && strcmp(s->parsers[i]->name, x) == 0) { t = s->parsers[i]->name; }
+  }
+  
+  for (i = 0; i < (int)(sizeof(tags) / sizeof(char*)) && t == NULL; i++) {
+    if (strcmp(tags[i], x) == 0) { t = (void*)tags[i]; }
+  }
+  
+  if (t == NULL) { mpc_save_fail(s, "Unknown tag '%s'!", x); }
+  
+  free(x);
+  return t;
+}
+
+static mpc_dfa_t *mpc_load_dfa(mpc_save_st_t *s) {
+  
+  int i;
+  mpc_dfa_t *d;
+  
+  int states_num = mpc_load_int(s);
+  
+  if (s->failure) { return NULL; }
+  
+  if (states_num <= 0 || states_num > MPC_DFA_STATES_MAX) {
+    mpc_save_fail(s, "Invalid DFA!", NULL);
+    return NULL;
+  }
+  
+  d = malloc(sizeof(mpc_dfa_t));
+  d->states_num = states_num;
+  d->trans = malloc(sizeof(int) * 256 * states_num);
+  d->accept = malloc(states_num);
+  
+  for (i = 0; i < states_num * 256; i++) { d->trans[i] = mpc_load_int(s); }
+  for (i = 0; i < states_num; i++) { d->accept[i] = mpc_load_char(s); }
+  
+  for (i = 0; i < states_num * 256 && !s->failure; i++) {
+    if (d->trans[i] < MPC_DFA_BAIL || d->trans[i] >= states_num) {
+      mpc_save_fail(s, "Invalid DFA!", NULL);
+    }
+  }
+  
+  if (s->failure) {
+    mpc_dfa_delete(d);
+    return NULL;
+  }
+  
+  return d;
+}
+
+static mpc_parser_t *mpc_load_parser(mpc_save_st_t *s) {
+  
+  int i, n;
+  mpc_parser_t *p;
+  int type = mpc_load_int(s);
+  
+  if (s->failure) { return mpc_undefined(); }
+  
+  if (type < 0) {
+    if (-1-type < s->parsers_num) { return s->parsers[-1-type]; }
+    mpc_save_fail(s, "Invalid parser!", NULL);
+    return mpc_undefined();
+  }
+  
+  p = mpc_undefined();
+  p->type = type;
+  p->ast = mpc_load_char(s);
+  
+  if (p->ast < MPC_AST_NONE || p->ast > MPC_AST_FOLD) {
+    mpc_save_fail(s, "Invalid parser!", NULL);
+    p->ast = MPC_AST_NONE;
+  }
+  
+  switch (type) {
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_ANY:
+      break;
+    
+    case MPC_TYPE_FAIL: p->data.fail.m = mpc_load_string(s); break;
+    
+    case MPC_TYPE_LIFT:
+      p->data.lift.lf = (mpc_ctor_t)mpc_load_func(s, MPC_FUNC_PLAIN);
+      p->data.lift.x = NULL;
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      p->data.expect.x = mpc_load_parser(s);
+      p->data.expect.m = mpc_load_string(s);
+      break;
+    
+    case MPC_TYPE_SINGLE:
+      p->data.single.x = mpc_load_char(s);
+      break;
+    
+    case MPC_TYPE_RANGE:
+      p->data.range.x = mpc_load_char(s);
+      p->data.range.y = mpc_load_char(s);
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      p->data.string.x = mpc_load_string(s);
+      break;
+    
+    case MPC_TYPE_APPLY:
+      p->data.apply.x = mpc_load_parser(s);
+      p->data.apply.f = (mpc_apply_t)mpc_load_func(s, MPC_FUNC_PLAIN);
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      p->data.apply_to.x = mpc_load_parser(s);
+      p->data.apply_to.f = (mpc_apply_to_t)mpc_load_func(s, MPC_FUNC_TAG);
+      p->data.apply_to.d = mpc_load_tag(s);
+      break;
+    
+    case MPC_TYPE_PREDICT: p->data.predict.x = mpc_load_parser(s); break;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      p->data.not.x = mpc_load_parser(s);
+      p->data.not.dx = (mpc_dtor_t)mpc_load_func(s, MPC_FUNC_PLAIN);
+      p->data.not.lf = (mpc_ctor_t)mpc_load_func(s, MPC_FUNC_PLAIN);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      p->data.repeat.n = mpc_load_int(s);
+      p->data.repeat.f = (mpc_fold_t)mpc_load_func(s, MPC_FUNC_PLAIN);
+      p->data.repeat.x = mpc_load_parser(s);
+      p->data.repeat.dx = (mpc_dtor_t)mpc_load_func(s, MPC_FUNC_PLAIN);
+      break;
+    
+    case MPC_TYPE_OR:
+      n = mpc_load_int(s);
+      if (n < 0 || s->failure) { mpc_save_fail(s, "Invalid parser!", NULL); n = 0; }
+      p->data.or.n = n;
+      p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+      p->data.or.first = NULL;
+      for (i = 0; i < n; i++) { p->data.or.xs[i] = mpc_load_parser(s); }
+      break;
+    
+    case MPC_TYPE_AND:
+      n = mpc_load_int(s);
+      if (n < 0 || s->failure) { mpc_save_fail(s, "Invalid parser!", NULL); n = 0; }
+      p->data.and.n = n;
+      p->data.and.f = (mpc_fold_t)mpc_load_func(s, MPC_FUNC_PLAIN);
+      p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+      p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n > 0 ? n-1 : 0));
+      for (i = 0; i < n; i++) { p->data.and.xs[i] = mpc_load_parser(s); }
+      for (i = 0; i < n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_load_func(s, MPC_FUNC_PLAIN); }
+      break;
+    
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_load_parser(s);
+      p->data.dfa.d = mpc_load_dfa(s);
+      if (p->data.dfa.d == NULL) {
+        mpc_undefine_unretained(p->data.dfa.x, 0);
+        p->type = MPC_TYPE_UNDEFINED;
+      }
+      break;
+    
+    default:
+      mpc_save_fail(s, "Invalid parser!", NULL);
+      p->type = MPC_TYPE_UNDEFINED;
+      break;
+  }
+  
+  return p;
+}
+
+mpc_err_t *mpc_load(FILE *f, int n, ...) {
+  
+  int i;
+  char magic[sizeof(mpc_save_magic)];
+  char *name;
+  mpc_save_st_t s;
+  mpc_parser_t **defs;
+  mpc_err_t *e;
+  va_list va;
+  
+  s.f = f;
+  s.parsers_num = n;
+  s.parsers = malloc(sizeof(mpc_parser_t*) * n);
+  s.failure = NULL;
+  
+  va_start(va, n);
+  for (i = 0; i < n; i++) { s.parsers[i] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
+  
+  if (fread(magic, 1, sizeof(magic), f) != sizeof(magic)
+  ||  memcmp(magic, mpc_save_magic, sizeof(magic)) != 0) {
+    mpc_save_fail(&s, "Not a saved parser file!", NULL);
+  }
+  
+  if (!s.failure && mpc_load_int(&s) != MPC_SAVE_VERSION) {
+    mpc_save_fail(&s, "Saved parser file is of another version!", NULL);
+  }
+  
+  if (!s.failure && mpc_load_int(&s) != n) {
+    mpc_save_fail(&s, "Wrong number of parsers given!", NULL);
+  }
+  
+  for (i = 0; i < n && !s.failure; i++) {
+    name = mpc_load_string(&s);
+    if (!s.parsers[i]->retained || !s.parsers[i]->name || strcmp(s.parsers[i]->name, name) != 0) {
+      mpc_save_fail(&s, "Parser '%s' wasn't given in its place!", name);
+    }
+    free(name);
+  }
+  
+  defs = calloc(n, sizeof(mpc_parser_t*));
+  for (i = 0; i < n && !s.failure; i++) {
+    defs[i] = mpc_load_parser(&s);
+    if (defs[i]->retained) {
+      defs[i] = NULL;
+      mpc_save_fail(&s, "Invalid parser!", NULL);
+    }
+  }
+  
+  if (!s.failure && fgetc(f) != EOF) {
+    mpc_save_fail(&s, "Unexpected data at end of file!", NULL);
+  }
+  
+  e = mpc_save_err(&s, "<mpc_load>");
+  
+  for (i = 0; i < n; i++) {
+    if (defs[i] == NULL) { continue; }
+    if (e || defs[i]->type == MPC_TYPE_UNDEFINED) {
+      mpc_undefine_unretained(defs[i], 0);
+    } else {
+      mpc_define(s.parsers[i], defs[i]);
+    }
+  }
+  
+  if (e == NULL) { mpc_first_build(n, s.parsers); }
+  
+  free(defs);
+  free(s.parsers);
+  return e;
+}
@@ -56,6 +56,7 @@ struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_buffer(const char *filename, const char *buffer, int length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
@@ -71,6 +72,12 @@ typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
 typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 
+/*
+** Packrat Parsing
+*/
+
+int mpc_parse_packrat(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Building a Parser
 */
@@ -237,6 +244,13 @@ mpc_parser_t *mpc_re(const char *re);
   
 /*
 ** AST
+**
+** Tags are interned. The `tag` of a node is shared
+** with every other node of that tag and lives until
+** the program exits, so it must never be freed or
+** reallocated. Change tags with `mpc_ast_tag` and
+** `mpc_ast_add_tag` only. `tag_id` is the id of the
+** same tag, as given by `mpc_tag_id`.
 */
 
 typedef struct mpc_ast_t {
@@ -244,6 +258,7 @@ typedef struct mpc_ast_t {
   char *contents;
   int children_num;
   struct mpc_ast_t** children;
+  int tag_id;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -253,11 +268,32 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 
+int mpc_tag_id(const char *t);
+int mpc_tag_head(int id);
+int mpc_tag_rest(int id);
+
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
 
+struct mpc_arena_t;
+typedef struct mpc_arena_t mpc_arena_t;
+
+mpc_arena_t *mpc_arena_new(void);
+void mpc_arena_clear(mpc_arena_t *a);
+void mpc_arena_delete(mpc_arena_t *a);
+
+int mpc_parse_arena(const char *filename, const char *string, mpc_parser_t *p, mpc_arena_t *a, mpc_result_t *r);
+
+struct mpc_context_t;
+typedef struct mpc_context_t mpc_context_t;
+
+mpc_context_t *mpc_context_new(void);
+void mpc_context_delete(mpc_context_t *c);
+
+int mpc_parse_context(mpc_context_t *c, const char *filename, const char *buffer, int length, mpc_parser_t *p, mpc_arena_t *a, mpc_result_t *r);
+
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
 
@@ -289,6 +325,13 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Saving & Loading
+*/
+
+mpc_err_t *mpc_save(FILE *f, int n, ...);
+mpc_err_t *mpc_load(FILE *f, int n, ...);
+
 /*
 ** Debug & Testing
 */
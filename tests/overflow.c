@@ -0,0 +1,122 @@
+/** 
+ * Checks that the arithmetic kernels and the packed kernels, with every sum kernel this CPU supports, agree
+ * with exact arithmetic: the same number when the result fits in a long, and an error when it doesn't
+ *
+ *   gcc -std=c11 -O2 -pthread tests/overflow.c mpc.c -lm -lreadline -o overflow && ./overflow
+ */
+#define main lispc_main
+#include "../variables.c"
+#undef main
+
+/** 
+ * The exact result of `op` on `x` and `nums`, with `*fits` cleared if it doesn't fit in a long, or if it
+ * divides by zero
+ */
+long overflow_exact(int op, long x, const long* nums, int count, int* fits) {
+    /* Products are kept within 2^63 + 1 in magnitude, which is still too big but can't overflow 128 bits */
+    const __int128 big = ((__int128)1 << 63) + 1;
+    __int128 r = x;
+
+    if (op == LOP_SUB && count == 0) { r = -r; }
+
+    for (int i = 0; i < count; ++i) {
+        if (op == LOP_ADD) { r += nums[i]; }
+        if (op == LOP_SUB) { r -= nums[i]; }
+        if (op == LOP_MUL) {
+            r *= nums[i];
+            if (r > big)  { r = big; }
+            if (r < -big) { r = -big; }
+        }
+        /* Division can't be reordered, so each quotient on the way must fit too */
+        if (op == LOP_DIV) {
+            if (nums[i] == 0 || r / nums[i] > LONG_MAX) { *fits = 0; return 0; }
+            r /= nums[i];
+        }
+    }
+
+    *fits = r >= LONG_MIN && r <= LONG_MAX;
+    return (long)r;
+}
+
+/** 
+ * Check that `x` is the exact result, or the error for it. Returns 0 and says so if it isn't
+ */
+int overflow_check(lval* x, int op, long exact, int fits, const char* path) {
+    int ok = fits ? x->type == LVAL_NUM && x->num == exact : x->type == LVAL_ERR;
+    if (!ok) {
+        printf("%s kernel of operator %d: expected ", path, op);
+        if (fits) { printf("%ld", exact); } else { printf("an error"); }
+        if (x->type == LVAL_NUM) { printf(", got %ld\n", x->num); } else { printf(", got %s\n", x->err); }
+    }
+    lval_del(x);
+    return ok;
+}
+
+/** 
+ * A number likely to overflow, near zero or the ends of a long
+ */
+long overflow_num(void) {
+    static const long edges[] = { 0, 1, -1, 2, -2, 3, LONG_MAX, LONG_MIN, LONG_MAX - 1, LONG_MIN + 1,
+                                  LONG_MAX / 2, LONG_MIN / 2, 1L << 32, -(1L << 32), 1L << 62, -(1L << 62) };
+    int n = sizeof(edges) / sizeof(edges[0]);
+    int k = rand() % (n + 1);
+
+    return k < n ? edges[k] : (long)(((unsigned long)rand() << 33) ^ ((unsigned long)rand() << 2) ^ rand());
+}
+
+int main(void) {
+    lval_small_init();
+
+    /* Every sum kernel this CPU supports */
+    lreduce sums[3] = { lnums_sum_scalar };
+    const char* names[3] = { "scalar" };
+    int sums_count = 1;
+#ifdef LISPC_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) { sums[sums_count] = lnums_sum_sse2; names[sums_count++] = "sse2"; }
+    if (__builtin_cpu_supports("avx2")) { sums[sums_count] = lnums_sum_avx2; names[sums_count++] = "avx2"; }
+#endif
+
+    long nums[40];
+    lval* cell[40];
+    int failures = 0;
+
+    srand(1);
+    for (int t = 0; t < 20000; ++t) {
+        int count = rand() % 40;
+        long x = overflow_num();
+        for (int i = 0; i < count; ++i) {
+            nums[i] = overflow_num();
+            cell[i] = lval_num(nums[i]);
+        }
+
+        for (int op = 0; op < LOP_COUNT; ++op) {
+            int fits;
+            long exact = overflow_exact(op, x, nums, count, &fits);
+
+            failures += !overflow_check(lop_kernels[op](x, cell, count), op, exact, fits, "cell");
+            for (int k = 0; k < sums_count; ++k) {
+                lnums_sum = sums[k];
+                failures += !overflow_check(lpop_kernels[op](x, nums, count), op, exact, fits, names[k]);
+            }
+        }
+
+        for (int i = 0; i < count; ++i) { lval_del(cell[i]); }
+    }
+
+    /* The operators and the reductions agree on the empty q-expression too */
+    failures += !overflow_check(builtin_add(NULL, lval_add(lval_sexpr(), lval_qexpr())), LOP_ADD, 0, 1, "empty");
+    failures += !overflow_check(builtin_sum(NULL, lval_add(lval_sexpr(), lval_qexpr())), LOP_ADD, 0, 1, "empty");
+    failures += !overflow_check(builtin_mul(NULL, lval_add(lval_sexpr(), lval_qexpr())), LOP_MUL, 1, 1, "empty");
+    failures += !overflow_check(builtin_product(NULL, lval_add(lval_sexpr(), lval_qexpr())), LOP_MUL, 1, 1, "empty");
+    failures += !overflow_check(builtin_sub(NULL, lval_add(lval_sexpr(), lval_qexpr())), LOP_SUB, 0, 0, "empty");
+    failures += !overflow_check(builtin_div(NULL, lval_add(lval_sexpr(), lval_qexpr())), LOP_DIV, 0, 0, "empty");
+
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+
+    puts("ok");
+    return 0;
+}
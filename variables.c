@@ -1,15 +1,47 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #include "mpc.h"
 
+/* Vectorized reductions are only built for 64-bit x86 with GCC-compatible compilers */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__LP64__) && !defined(LISPC_NO_SIMD)
+#define LISPC_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Storage class of variables which every thread has its own copy of */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define LTHREAD_LOCAL _Thread_local
+#else
+#define LTHREAD_LOCAL __thread
+#endif
+
 struct lval;
 struct lenv;
+struct lcode;
+struct lsymtab;
+struct lpool;
+struct lreader;
+struct lframe;
+struct lloader;
+struct lworker;
+struct lwriter;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lsymtab lsymtab;
+typedef struct lpool lpool;
+typedef struct lreader lreader;
+typedef struct lframe lframe;
+typedef struct lloader lloader;
+typedef struct lworker lworker;
+typedef struct lwriter lwriter;
 
 /** 
  * Enumeration of all possible type of lval types
@@ -22,365 +54,1283 @@ enum { LVAL_NUM, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_ERR };
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
 /** 
- * Declare lisp value (lval) struct
+ * Enumeration of all arithmetic operators, used to index the kernel table
+ */
+enum { LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_COUNT };
+
+/** 
+ * Declare arithmetic kernel type, which folds the numbers in `cell` into `x`
+ */
+typedef lval*(*lkernel)(long x, lval** cell, int count);
+
+/** 
+ * Declare packed kernel type, which folds the packed numbers in `nums` into `x`
+ */
+typedef lval*(*lpkernel)(long x, const long* nums, int count);
+
+/** 
+ * Declare reduction type, which sums `count` packed numbers wrapping around, adding to `carry` how many
+ * times the sum wrapped up and taking away how many times it wrapped down
+ */
+typedef long(*lreduce)(const long* nums, int count, long* carry);
+
+/** 
+ * Declare lisp value (lval) struct. Values are reference-counted and shared, so a value
+ * must not be modified once it has more than one reference (see `lval_own`)
  */
 struct lval {
     /* The type of the value, the possible values are listed in enum above */
     int   type;
 
-    long  num;
-    char* err;
-    char* sym;
-    lbuiltin fun;
+    /* Number of references to this value, or LVAL_IMMORTAL for values that are never deleted */
+    int   refs;
+
+    /* The payload of the value. Which member is in use depends on the type */
+    union {
+        long     num;
+        char*    err;
+        int      sym;
+        lbuiltin fun;
+
+        /* Count and pointer to list of `lval*`. `cell` points `off` slots into an array of `cap` slots,
+           so popping the front only moves the pointer. Packed lists of numbers keep plain `long`s in
+           `nums` instead. `code` is the list compiled as a call, once it's been run (see `lval_code`) */
+        struct {
+            int    count;
+            int    cap;
+            int    off;
+            int    packed;
+            union {
+                lval** cell;
+                long*  nums;
+            };
+            lcode* code;
+        };
+    };
+};
+
+/** 
+ * Reference count of values which are shared by everyone and never deleted
+ */
+#define LVAL_IMMORTAL -1
+
+/** 
+ * Range of the numbers which are preallocated, so `lval_num` never allocates them
+ */
+#define LVAL_SMALL_MIN -128
+#define LVAL_SMALL_MAX 1023
+
+/** 
+ * Minimum length of a q-expression of numbers to be read as a packed list
+ */
+#define LVAL_PACK_MIN 16
+
+/** 
+ * Number of size classes of cell arrays kept by the pool. Class `c` holds arrays of `1 << c` pointers
+ */
+#define LPOOL_CLASSES 4
+
+/** 
+ * Size of the chunks the pool carves its blocks from
+ */
+#define LPOOL_CHUNK_SIZE (64 * 1024)
+
+/** 
+ * Size of the buffer of the writer values are printed through
+ */
+#define LWRITER_SIZE (64 * 1024)
+
+/** 
+ * Declare the pool allocator for lval nodes and small cell arrays. Blocks are carved out of
+ * large chunks and recycled through free lists, instead of going through malloc and free.
+ * Building with LISPC_NO_POOL defined turns the pool off, while keeping its counters.
+ */
+struct lpool {
+    /* Free lists of lval nodes, and of cell arrays of every class. A free block stores the next one */
+    void*  free_vals;
+    void*  free_cells[LPOOL_CLASSES];
+
+    /* All chunks, linked through their first word, and how much of the newest one is used */
+    char*  chunks;
+    size_t chunk_used;
+
+    /* Counters for `lpool_report` */
+    long   vals_allocs;
+    long   cells_allocs;
+    long   sys_allocs;
+    long   chunks_count;
+};
 
-    /* Count and pointer to list of `lval*` */
+/** 
+ * Declare the table of interned symbols. Every distinct symbol name is stored once and
+ * identified by its index, so symbols can be compared and hashed as plain integers.
+ */
+struct lsymtab {
+    /* Names of the symbols, indexed by symbol id */
     int    count;
-    lval** cell;
+    int    slots;
+    char** names;
+
+    /* Open-addressing hash table of symbol ids, keyed by name. Empty buckets hold -1 */
+    int    buckets_count;
+    int*   buckets;
 };
 
 /** 
- * Declare the environment
+ * Declare the environment, which is an open-addressing hash table keyed by symbol id
  */
 struct lenv {
+    /* Number of bindings, and number of buckets (always a power of two) */
     int    count;
-    char** syms;
+    int    slots;
+
+    /* Symbol id of every bucket, or -1 if the bucket is empty */
+    int*   syms;
     lval** vals;
 };
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
-/* Lval */
+/** 
+ * Enumeration of all instructions understood by the virtual machine
+ */
+enum { LCODE_CONST, LCODE_LOOKUP, LCODE_CALL, LCODE_RET };
 
 /** 
- * Constructor for number-typed lval
+ * Declare compiled code, which is a flat array of instructions produced from an lval
  */
-lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
-    v->num  = x;
+struct lcode {
+    /* Instructions, each of them is an opcode followed by a single operand */
+    int   count;
+    int   slots;
+    int*  code;
+
+    /* Constants referred to by the instructions */
+    int    consts_count;
+    int    consts_slots;
+    lval** consts;
+
+    /* The maximum number of values the code keeps on the stack at once */
+    int   depth;
+
+    /* Number of references to the code, held by the list it was compiled from and by running frames */
+    int   refs;
+};
 
-    return v;
-}
+/** 
+ * Declare a suspended frame of the virtual machine, which is compiled code waiting for a call to return
+ */
+struct lframe {
+    lcode* c;
+    int    pc;
+};
 
 /** 
- * Constructor for error-typed lval
+ * Declare the state of the direct reader, which builds lvals straight from the source text
  */
-lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+struct lreader {
+    /* Name of the source, and the whole source text, which ends at `end` */
+    char* filename;
+    char* start;
+    char* end;
+
+    /* Current position in the source text */
+    char* s;
+
+    /* The syntax error found, if any */
+    lval* err;
+
+    /* The lists still open, innermost last, and the characters closing them */
+    int    depth;
+    int    slots;
+    lval** lists;
+    char*  closes;
+};
 
-    /* Create the variable-sized argument list and initialized it */
-    va_list va;
-    va_start(va, fmt);
+/** 
+ * Declare the loader, which reads many source files on a pool of threads before evaluating them in order
+ */
+struct lloader {
+    /* The files to load, and what each of them was read into */
+    int    count;
+    char** files;
+    lval** vals;
 
-    /* Allocate 512 bytes initially */
-    v->err = malloc(512);
+    /* The mpc grammar to read with, or NULL for the direct reader */
+    mpc_parser_t* grammar;
 
-    /* Print the error message */
-    vsnprintf(v->err, 511, fmt, va);
+    /* Index of the next file for a thread to take */
+    int             next;
+    pthread_mutex_t lock;
+};
 
-    /* Resize the allocated memory */
-    v->err = realloc(v->err, strlen(v->err) + 1);
+/** 
+ * Declare a thread of the loader. Everything it reads is carved from its own pool
+ */
+struct lworker {
+    lloader*  loader;
+    lpool     pool;
+    pthread_t thread;
+};
 
-    /* Clean up the variable-sized argument list */
-    va_end(va);
+/** 
+ * Declare the buffered writer. Output is gathered in one large buffer and written out a buffer at a time
+ */
+struct lwriter {
+    FILE*  f;
+    size_t used;
+    char   buf[LWRITER_SIZE];
+};
 
-    return v;
-}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/* Allocation */
 
 /** 
- * Constructor for symbol-typed lval
+ * The pool of the interpreter
  */
-lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym  = malloc(sizeof(s) + 1);
-    strcpy(v->sym, s);
+static lpool lvals_pool;
 
-    return v;
-}
+/** 
+ * The pool used by the calling thread. Threads of the loader have their own, merged into the interpreter's one when done
+ */
+static LTHREAD_LOCAL lpool* lvals_local = &lvals_pool;
 
 /** 
- * Constructor for function-typed lval
+ * Get a block of `size` bytes from the pool, carving a new chunk if the current one is full
  */
-lval* lval_fun(lbuiltin func) {
-    lval* v  = malloc(sizeof(lval));
-    v->type  = LVAL_FUN;
-    v->fun   = func;
+void* lpool_carve(size_t size) {
+    /* Keep every block aligned to pointers */
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    if (lvals_local->chunks == NULL || lvals_local->chunk_used + size > LPOOL_CHUNK_SIZE) {
+        char* chunk = malloc(LPOOL_CHUNK_SIZE);
+        *(char**)chunk = lvals_local->chunks;
+        lvals_local->chunks     = chunk;
+        lvals_local->chunk_used = sizeof(void*);
+        lvals_local->sys_allocs++;
+        lvals_local->chunks_count++;
+    }
 
-    return v;
+    void* block = lvals_local->chunks + lvals_local->chunk_used;
+    lvals_local->chunk_used += size;
+
+    return block;
 }
 
 /** 
- * Constructor for s-expression-typed lval
+ * Allocate an lval node
  */
-lval* lval_sexpr(void) {
-    lval* v  = malloc(sizeof(lval));
-    v->type  = LVAL_SEXPR;
-    v->count = 0;
-    v->cell  = NULL;
+lval* lval_alloc(void) {
+    lvals_local->vals_allocs++;
+
+#ifdef LISPC_NO_POOL
+    lvals_local->sys_allocs++;
+    return malloc(sizeof(lval));
+#else
+    /* Reuse a freed node if there's any */
+    void* v = lvals_local->free_vals;
+    if (v) {
+        lvals_local->free_vals = *(void**)v;
+        return v;
+    }
 
-    return v;
+    return lpool_carve(sizeof(lval));
+#endif
 }
 
 /** 
- * Constructor for q-expression-typed lval
+ * Give an lval node back to the pool
  */
-lval* lval_qexpr(void) {
-    lval* v  = malloc(sizeof(lval));
-    v->type  = LVAL_QEXPR;
-    v->count = 0;
-    v->cell  = NULL;
+void lval_free(lval* v) {
+#ifdef LISPC_NO_POOL
+    free(v);
+#else
+    *(void**)v = lvals_local->free_vals;
+    lvals_local->free_vals = v;
+#endif
+}
 
-    return v;
+/** 
+ * Get the class of a cell array holding `count` pointers. LPOOL_CLASSES means it's too large for the pool
+ */
+int lcells_class(int count) {
+    int c = 0;
+    while (c < LPOOL_CLASSES && (1 << c) < count) { c++; }
+
+    return c;
 }
 
 /** 
- * Destructor for lval
+ * Get the number of pointers a cell array allocated for `count` pointers can really hold
  */
-void lval_del(lval* v) {
-    /* We need to free all the malloc-ed variables inside the lval first */
-    switch (v->type) {
-        /* Num-typed lval doesn't allocate any memory, so `break` */
-        case LVAL_NUM: break;
+int lcells_capacity(int count) {
+    if (count == 0) { return 0; }
 
-        case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
-        case LVAL_FUN: break;
+#ifndef LISPC_NO_POOL
+    int c = lcells_class(count);
+    if (c < LPOOL_CLASSES) { return 1 << c; }
+#endif
 
-        /* For sexpr-typed and qexpr-typed lval, we need to recursively delete its contents */
-        case LVAL_SEXPR:
-        case LVAL_QEXPR:
-            for (int i = 0; i < v->count; ++i) {
-                lval_del(v->cell[i]);
-            }
-            /* Don't forget to free the memory allocated to store pointers */
-            free(v->cell);
-            break;
+    return count;
+}
+
+/** 
+ * Allocate a cell array with room for `count` pointers
+ */
+lval** lcells_alloc(int count) {
+    if (count == 0) { return NULL; }
+    lvals_local->cells_allocs++;
+
+#ifndef LISPC_NO_POOL
+    int c = lcells_class(count);
+    if (c < LPOOL_CLASSES) {
+        /* Reuse a freed array of the same class if there's any */
+        void* cells = lvals_local->free_cells[c];
+        if (cells) {
+            lvals_local->free_cells[c] = *(void**)cells;
+            return cells;
+        }
+
+        return lpool_carve(sizeof(lval*) << c);
     }
+#endif
 
-    /* Finally, we can safely free the lval itself */
-    free(v);
+    lvals_local->sys_allocs++;
+    return malloc(sizeof(lval*) * count);
 }
 
-lval* lval_copy(lval* v) {
-    /* Create the new lval */
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
-
-    switch (v->type) {
+/** 
+ * Give a cell array holding `count` pointers back to the pool
+ */
+void lcells_free(lval** cells, int count) {
+    if (count == 0) { return; }
+
+#ifndef LISPC_NO_POOL
+    int c = lcells_class(count);
+    if (c < LPOOL_CLASSES) {
+        *(void**)cells = lvals_local->free_cells[c];
+        lvals_local->free_cells[c] = cells;
+        return;
+    }
+#endif
 
-        /* Numbers and functions are copied directly */
-        case LVAL_NUM: x->num = v->num; break;
-        case LVAL_FUN: x->fun = v->fun; break;
+    free(cells);
+}
 
-        /* String-backed type are copied using strcpy */
-        case LVAL_SYM: x->sym = malloc(strlen(v->sym) + 1); strcpy(x->sym, v->sym); break;
-        case LVAL_ERR: x->err = malloc(strlen(v->err) + 1); strcpy(x->err, v->err); break;
+/** 
+ * Grow a cell array of `count` pointers to `new_count` pointers, keeping its contents
+ */
+lval** lcells_grow(lval** cells, int count, int new_count) {
+    /* Arrays too large for the pool are simply reallocated */
+    if (count && lcells_class(count) == LPOOL_CLASSES) {
+        lvals_local->cells_allocs++;
+        lvals_local->sys_allocs++;
+        return realloc(cells, sizeof(lval*) * new_count);
+    }
 
-        /* Copy iist-type value by copying each sub-expressions */
-        case LVAL_SEXPR:
-        case LVAL_QEXPR:
-            x->count = v->count;
-            x->cell  = malloc(sizeof(lval*) * x->count);
-            for (int i = 0; i < v->count; ++i) {
-                x->cell[i] = lval_copy(v->cell[i]);
-            }
-            break;
+    /* Otherwise, move the contents to a new array */
+    lval** new_cells = lcells_alloc(new_count);
+    if (count) {
+        memcpy(new_cells, cells, sizeof(lval*) * count);
     }
+    lcells_free(cells, count);
 
-    return x;
+    return new_cells;
 }
 
 /** 
- * Add lval to a s-expression
+ * Release all chunks of the pool. Only valid once every lval has been deleted
  */
-lval* lval_add(lval* v, lval* x) {
-    /* Increase the count of contained elements */
-    v->count++;
+void lpool_clear(void) {
+    while (lvals_pool.chunks) {
+        char* next = *(char**)lvals_pool.chunks;
+        free(lvals_pool.chunks);
+        lvals_pool.chunks = next;
+    }
 
-    /* Re-allocate memory to fit the needs */
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    lvals_pool.free_vals = NULL;
+    memset(lvals_pool.free_cells, 0, sizeof(lvals_pool.free_cells));
+}
 
-    /* Finally, really add the new lval */
-    v->cell[v->count - 1] = x;
+/** 
+ * Put the list `list`, linked through the first word of every block, in front of the list at `head`
+ */
+void lpool_splice(void** head, void* list) {
+    if (list == NULL) { return; }
 
-    return v;
+    void* tail = list;
+    while (*(void**)tail) { tail = *(void**)tail; }
+    *(void**)tail = *head;
+    *head = list;
 }
 
 /** 
- * Pop an element inside lval v with index i
+ * Hand the chunks and free blocks of the pool `p` to the interpreter's pool, which then owns every value carved from them
  */
-lval* lval_pop(lval* v, int i) {
-    lval* x = v->cell[i];
-
-    /* Shift the memory */
-    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
+void lpool_merge(lpool* p) {
+    /* The chunks go behind the newest one, which is still being carved */
+    if (lvals_pool.chunks) {
+        lpool_splice((void**)lvals_pool.chunks, p->chunks);
+    } else {
+        lvals_pool.chunks     = p->chunks;
+        lvals_pool.chunk_used = p->chunk_used;
+    }
 
-    /* Reduce the count of elements in the `v` */
-    v->count--;
+    lpool_splice(&lvals_pool.free_vals, p->free_vals);
+    for (int c = 0; c < LPOOL_CLASSES; ++c) {
+        lpool_splice(&lvals_pool.free_cells[c], p->free_cells[c]);
+    }
 
-    /* Reallocate the needed memory to store the elements of `v` */
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    lvals_pool.vals_allocs  += p->vals_allocs;
+    lvals_pool.cells_allocs += p->cells_allocs;
+    lvals_pool.sys_allocs   += p->sys_allocs;
+    lvals_pool.chunks_count += p->chunks_count;
 
-    return x;
+    memset(p, 0, sizeof(lpool));
 }
 
 /** 
- * Merge lval `y` into lval `x`
+ * Print how many allocations were made, and how many of them reached the system allocator
  */
-lval* lval_join(lval* x, lval* y) {
-    /* One-by-one pop element in `y` and insert it to `x` */
-    while (y->count) { 
-        x = lval_add(x, lval_pop(y, 0));
-    }
+void lpool_report(FILE* f) {
+    fprintf(f, "lval nodes allocated:     %li\n", lvals_pool.vals_allocs);
+    fprintf(f, "cell arrays allocated:    %li\n", lvals_pool.cells_allocs);
+    fprintf(f, "system allocator calls:   %li\n", lvals_pool.sys_allocs);
+    fprintf(f, "pool chunks:              %li\n", lvals_pool.chunks_count);
+}
 
-    /* Delete the now empty `y` */
-    lval_del(y);
+/* Allocation */
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    return x;
-}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/* Symbols */
 
-lval* lval_take(lval* v, int i) {
-    lval* x = lval_pop(v, i);
-    lval_del(v);
+/** 
+ * The symbols interned so far
+ */
+static lsymtab lsyms = { 0, 0, NULL, 0, NULL };
 
-    return x;
+/** 
+ * Lock of the symbol table, which the threads of the loader intern into at once
+ */
+static pthread_mutex_t lsyms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** 
+ * Hash a symbol name of `len` characters (FNV-1a)
+ */
+unsigned int lsym_hash(char* s, int len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+
+    return h;
 }
 
 /** 
- * Forward-declared because `lval_print` and `lval_println` need each other
+ * Rebuild the buckets of the symbol table with `count` buckets
  */
-void lval_print(lval* v);
+void lsym_rehash(int count) {
+    free(lsyms.buckets);
+    lsyms.buckets_count = count;
+    lsyms.buckets       = malloc(sizeof(int) * count);
+    memset(lsyms.buckets, -1, sizeof(int) * count);
+
+    for (int id = 0; id < lsyms.count; ++id) {
+        unsigned int i = lsym_hash(lsyms.names[id], strlen(lsyms.names[id])) & (count - 1);
+        while (lsyms.buckets[i] != -1) { i = (i + 1) & (count - 1); }
+        lsyms.buckets[i] = id;
+    }
+}
 
 /** 
- * Print the whole expression
+ * Find the symbol named by the `len` characters at `s`, adding it if it's not there yet. `lsyms_lock` must be held
  */
-void lval_print_expr(lval* v, char open, char close) {
-    putchar(open);
+int lsym_find_n(char* s, int len) {
+    /* Keep the table at most half full, so probe sequences stay short */
+    if (lsyms.count * 2 >= lsyms.buckets_count) {
+        lsym_rehash(lsyms.buckets_count ? lsyms.buckets_count * 2 : 256);
+    }
 
-    for (int i = 0; i < v->count; ++i) {
-        /* Print the current cell */
-        lval_print(v->cell[i]);
+    /* Probe until either the symbol or an empty bucket is found */
+    unsigned int mask = lsyms.buckets_count - 1;
+    unsigned int i    = lsym_hash(s, len) & mask;
+    while (lsyms.buckets[i] != -1) {
+        char* name = lsyms.names[lsyms.buckets[i]];
+        if (strncmp(name, s, len) == 0 && name[len] == '\0') { return lsyms.buckets[i]; }
+        i = (i + 1) & mask;
+    }
 
-        /* If current cell is *NOT* the last element, put trailing space */
-        if (i != (v->count - 1)) {
-            putchar(' ');
-        }
+    /* It's a new symbol, so store its name */
+    if (lsyms.count == lsyms.slots) {
+        lsyms.slots = lsyms.slots ? lsyms.slots * 2 : 256;
+        lsyms.names = realloc(lsyms.names, sizeof(char*) * lsyms.slots);
     }
+    lsyms.names[lsyms.count] = malloc(len + 1);
+    memcpy(lsyms.names[lsyms.count], s, len);
+    lsyms.names[lsyms.count][len] = '\0';
+    lsyms.buckets[i] = lsyms.count;
 
-    putchar(close);
+    return lsyms.count++;
 }
 
 /** 
- * Print an lval
+ * Get the id of the symbol named by the `len` characters at `s`, adding it to the table if it's not there yet
  */
-void lval_print(lval* v) {
-    switch (v->type) {
-        case LVAL_NUM:   printf("%li", v->num);        break;
-        case LVAL_ERR:   printf("Error: %s", v->err);  break;
-        case LVAL_SYM:   printf("%s", v->sym);         break;
-        case LVAL_FUN:   printf("<function>");         break;
-        case LVAL_SEXPR: lval_print_expr(v, '(', ')'); break;
-        case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
-    }
+int lsym_intern_n(char* s, int len) {
+    pthread_mutex_lock(&lsyms_lock);
+    int id = lsym_find_n(s, len);
+    pthread_mutex_unlock(&lsyms_lock);
+
+    return id;
 }
 
 /** 
- * Print an lval, followed by a newline
+ * Get the id of the symbol named `s`, adding it to the table if it's not there yet
  */
-void lval_println(lval* v) {
-    lval_print(v);
-    putchar('\n');
+int lsym_intern(char* s) {
+    return lsym_intern_n(s, strlen(s));
 }
 
-char* ltype_name(int t) {
-    switch(t) {
-        case LVAL_NUM: return "Number";
-        case LVAL_ERR: return "Error";
-        case LVAL_SYM: return "Symbol";
-        case LVAL_FUN: return "Function";
-        case LVAL_SEXPR: return "S-Expression";
-        case LVAL_QEXPR: return "Q-Expression";
-        default: return "Unknown";
-    }
+/** 
+ * Get the name of the symbol with id `id`. This doesn't lock, so no other thread may be interning meanwhile
+ */
+char* lsym_name(int id) {
+    return lsyms.names[id];
 }
 
-/* lval */
+/* Symbols */
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-/* lenv */
+/* Output */
 
 /** 
- * Constructor for environment
+ * The writer of the standard output. Nothing reaches the stream until it's flushed
  */
-lenv* lenv_new(void) {
-    lenv* e  = malloc(sizeof(lenv));
-    e->count = 0;
-    e->syms  = NULL;
-    e->vals  = NULL;
+static lwriter lout = { NULL, 0, { 0 } };
 
-    return e;
+/** 
+ * Write out everything buffered so far
+ */
+void lout_flush(void) {
+    if (lout.used) {
+        fwrite(lout.buf, 1, lout.used, lout.f ? lout.f : stdout);
+        lout.used = 0;
+    }
 }
 
-void lenv_del(lenv* e) {
-    for (int i = 0; i < e->count; ++i) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+/** 
+ * Write the `len` characters at `s`
+ */
+void lout_write(const char* s, size_t len) {
+    if (lout.used + len > LWRITER_SIZE) {
+        lout_flush();
+
+        /* Anything as large as the buffer is written out as it is */
+        if (len >= LWRITER_SIZE) {
+            fwrite(s, 1, len, lout.f ? lout.f : stdout);
+            return;
+        }
     }
 
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    memcpy(lout.buf + lout.used, s, len);
+    lout.used += len;
 }
 
 /** 
- * Get a symbol k in the environment e
+ * Write the character c
  */
-lval* lenv_get(lenv* e, lval* k) {
-    /* Iterate all items in the environment */
-    for (int i = 0; i < e->count; ++i) {
-        /* Check if the stored symbol matches. If it is, return its copy */
-        if (strcmp(e->syms[i], k->sym) == 0) { return lval_copy(e->vals[i]); }
-    }
+void lout_char(char c) {
+    if (lout.used == LWRITER_SIZE) { lout_flush(); }
+    lout.buf[lout.used++] = c;
+}
 
-    return lval_err("Unbound symbol '%s'", k->sym);
+/** 
+ * Write the string s
+ */
+void lout_str(const char* s) {
+    lout_write(s, strlen(s));
 }
 
 /** 
- * Put a new variable named k with value v in environment e
+ * Every number from 00 to 99, as two digits
  */
-void lenv_put(lenv* e, lval* k, lval* v) {
-    /* Iterate all items to check whether k exists */
-    for (int i = 0; i < e->count; ++i) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            /* Delete the existing value */
-            lval_del(e->vals[i]);
-            /* Replace with the new one */
-            e->vals[i] = lval_copy(v);
+static const char lout_digits[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
 
-            return;
-        }
+/** 
+ * Write the number x in decimal. Digits are made two at a time from the back, rather than through printf
+ */
+void lout_num(long x) {
+    char  digits[24];
+    char* p = digits + sizeof(digits);
+
+    /* Work on the magnitude unsigned, so the most negative number doesn't overflow */
+    unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+
+    while (u >= 100) {
+        p -= 2;
+        memcpy(p, &lout_digits[(u % 100) * 2], 2);
+        u /= 100;
     }
 
-    /* If this is executed, it means that the variable doesn't exist. So, set it up. */
+    if (u >= 10) {
+        p -= 2;
+        memcpy(p, &lout_digits[u * 2], 2);
+    } else {
+        *--p = '0' + u;
+    }
 
-    /* Reallocate the environment's vals and syms storage */
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(lval*) * e->count);
+    if (x < 0) { *--p = '-'; }
 
-    /* Insert the value and its content */
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+    lout_write(p, digits + sizeof(digits) - p);
 }
 
-/* lenv */
+/* Output */
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-/* Built-ins */
+/* Lval */
+
+/** 
+ * The preallocated small numbers
+ */
+static lval lval_small_nums[LVAL_SMALL_MAX - LVAL_SMALL_MIN + 1];
+
+/** 
+ * Prepare the preallocated small numbers. Must be called before any lval is made
+ */
+void lval_small_init(void) {
+    for (long x = LVAL_SMALL_MIN; x <= LVAL_SMALL_MAX; ++x) {
+        lval* v = &lval_small_nums[x - LVAL_SMALL_MIN];
+        v->type = LVAL_NUM;
+        v->refs = LVAL_IMMORTAL;
+        v->num  = x;
+    }
+}
+
+/** 
+ * Constructor for number-typed lval
+ */
+lval* lval_num(long x) {
+    /* Small numbers are shared, rather than allocated */
+    if (x >= LVAL_SMALL_MIN && x <= LVAL_SMALL_MAX) { return &lval_small_nums[x - LVAL_SMALL_MIN]; }
+
+    lval* v = lval_alloc();
+    v->type = LVAL_NUM;
+    v->refs = 1;
+    v->num  = x;
+
+    return v;
+}
+
+/** 
+ * Constructor for error-typed lval
+ */
+lval* lval_err(char* fmt, ...) {
+    lval* v = lval_alloc();
+    v->type = LVAL_ERR;
+    v->refs = 1;
+
+    /* Create the variable-sized argument list and initialized it */
+    va_list va;
+    va_start(va, fmt);
+
+    /* Allocate 512 bytes initially */
+    v->err = malloc(512);
+
+    /* Print the error message */
+    vsnprintf(v->err, 511, fmt, va);
+
+    /* Resize the allocated memory */
+    v->err = realloc(v->err, strlen(v->err) + 1);
+
+    /* Clean up the variable-sized argument list */
+    va_end(va);
+
+    return v;
+}
+
+/** 
+ * Constructor for symbol-typed lval, named by the `len` characters at `s`
+ */
+lval* lval_sym_n(char* s, int len) {
+    lval* v = lval_alloc();
+    v->type = LVAL_SYM;
+    v->refs = 1;
+    v->sym  = lsym_intern_n(s, len);
+
+    return v;
+}
+
+/** 
+ * Constructor for symbol-typed lval
+ */
+lval* lval_sym(char* s) {
+    return lval_sym_n(s, strlen(s));
+}
+
+/** 
+ * Constructor for function-typed lval
+ */
+lval* lval_fun(lbuiltin func) {
+    lval* v  = lval_alloc();
+    v->type  = LVAL_FUN;
+    v->refs  = 1;
+    v->fun   = func;
+
+    return v;
+}
+
+/** 
+ * Constructor for s-expression-typed lval
+ */
+lval* lval_sexpr(void) {
+    lval* v  = lval_alloc();
+    v->type  = LVAL_SEXPR;
+    v->refs  = 1;
+    v->count = 0;
+    v->cap   = 0;
+    v->off   = 0;
+    v->packed = 0;
+    v->cell  = NULL;
+    v->code  = NULL;
+
+    return v;
+}
+
+/** 
+ * Constructor for q-expression-typed lval
+ */
+lval* lval_qexpr(void) {
+    lval* v  = lval_alloc();
+    v->type  = LVAL_QEXPR;
+    v->refs  = 1;
+    v->count = 0;
+    v->cap   = 0;
+    v->off   = 0;
+    v->packed = 0;
+    v->cell  = NULL;
+    v->code  = NULL;
+
+    return v;
+}
+
+/** 
+ * Values whose last reference is gone, waiting for `lval_del` to delete them. Every thread has its own
+ */
+static LTHREAD_LOCAL lval** ldel_pending       = NULL;
+static LTHREAD_LOCAL int    ldel_pending_count = 0;
+static LTHREAD_LOCAL int    ldel_pending_slots = 0;
+
+/** 
+ * Forward-declared because lists keep the code compiled from them
+ */
+void lcode_del(lcode* c);
+void lcode_free(lcode* c);
+
+/** 
+ * Drop a reference to x while deleting a value, leaving x for later if it dies
+ */
+void lval_del_later(lval* x) {
+    if (x->refs == LVAL_IMMORTAL || --x->refs > 0) { return; }
+
+    if (ldel_pending_count == ldel_pending_slots) {
+        ldel_pending_slots = ldel_pending_slots ? ldel_pending_slots * 2 : 64;
+        ldel_pending       = realloc(ldel_pending, sizeof(lval*) * ldel_pending_slots);
+    }
+    ldel_pending[ldel_pending_count++] = x;
+}
+
+/** 
+ * Destructor for lval. Sub-expressions are deleted through a pending stack rather than recursion, so
+ * deeply nested values can't overflow the C stack
+ */
+void lval_del(lval* v) {
+    /* Drop this reference. Only the last one really deletes the value */
+    if (v->refs == LVAL_IMMORTAL) { return; }
+    if (--v->refs > 0) { return; }
+
+    while (1) {
+        /* We need to free all the malloc-ed variables inside the lval first */
+        switch (v->type) {
+            /* Num-typed lval doesn't allocate any memory, so `break` */
+            case LVAL_NUM: break;
+
+            /* Symbol names live in the symbol table, so there's nothing to free */
+            case LVAL_ERR: free(v->err); break;
+            case LVAL_SYM: break;
+            case LVAL_FUN: break;
+
+            /* For sexpr-typed and qexpr-typed lval, we need to delete its contents too */
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                /* The code compiled from the list goes too, unless it's still running */
+                if (v->code && --v->code->refs == 0) {
+                    for (int i = 0; i < v->code->consts_count; ++i) { lval_del_later(v->code->consts[i]); }
+                    lcode_free(v->code);
+                }
+
+                /* Packed numbers are plain values */
+                if (v->packed) {
+                    free(v->nums - v->off);
+                    break;
+                }
+
+                /* Drop the references to the sub-expressions, and leave the ones that die for later */
+                for (int i = 0; i < v->count; ++i) {
+                    lval_del_later(v->cell[i]);
+                }
+                /* Don't forget to free the memory allocated to store pointers */
+                lcells_free(v->cell - v->off, v->cap);
+                break;
+        }
+
+        /* Finally, we can safely free the lval itself */
+        lval_free(v);
+
+        /* Carry on with the values left for later, if there's any */
+        if (ldel_pending_count == 0) { break; }
+        v = ldel_pending[--ldel_pending_count];
+    }
+}
+
+/** 
+ * Take another reference to v
+ */
+lval* lval_ref(lval* v) {
+    if (v->refs != LVAL_IMMORTAL) { v->refs++; }
+    return v;
+}
+
+/** 
+ * Make a copy of v. Sub-expressions are shared rather than copied, since shared values are never modified
+ */
+lval* lval_copy(lval* v) {
+    /* Create the new lval */
+    lval* x = lval_alloc();
+    x->type = v->type;
+    x->refs = 1;
+
+    switch (v->type) {
+
+        /* Numbers, functions and symbol ids are copied directly */
+        case LVAL_NUM: x->num = v->num; break;
+        case LVAL_FUN: x->fun = v->fun; break;
+        case LVAL_SYM: x->sym = v->sym; break;
+
+        /* String-backed type are copied using strcpy */
+        case LVAL_ERR: x->err = malloc(strlen(v->err) + 1); strcpy(x->err, v->err); break;
+
+        /* Copy list-type value by referencing each sub-expressions */
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x->count  = v->count;
+            x->off    = 0;
+            x->packed = v->packed;
+            x->code   = NULL;
+
+            /* Packed numbers are copied directly */
+            if (v->packed) {
+                x->cap  = x->count;
+                x->nums = malloc(sizeof(long) * x->count);
+                memcpy(x->nums, v->nums, sizeof(long) * x->count);
+                break;
+            }
+
+            x->cap   = lcells_capacity(x->count);
+            x->cell  = lcells_alloc(x->count);
+            for (int i = 0; i < v->count; ++i) {
+                x->cell[i] = lval_ref(v->cell[i]);
+            }
+            break;
+    }
+
+    return x;
+}
+
+/** 
+ * Get a version of v that can be modified in place. If v is shared, this gives up the
+ * reference to v and returns a private copy instead
+ */
+lval* lval_own(lval* v) {
+    if (v->refs == 1) { return v; }
+
+    lval* x = lval_copy(v);
+    lval_del(v);
+
+    return x;
+}
+
+/** 
+ * Forget the code compiled from v, which is about to be modified
+ */
+void lval_uncode(lval* v) {
+    if (v->code) {
+        lcode_del(v->code);
+        v->code = NULL;
+    }
+}
+
+/** 
+ * Pack a q-expression holding only numbers into a plain array of `long`s, if it's long enough to be worth it
+ */
+void lval_pack(lval* v) {
+    if (v->type != LVAL_QEXPR || v->packed || v->count < LVAL_PACK_MIN) { return; }
+
+    for (int i = 0; i < v->count; ++i) {
+        if (v->cell[i]->type != LVAL_NUM) { return; }
+    }
+
+    long* nums = malloc(sizeof(long) * v->count);
+    for (int i = 0; i < v->count; ++i) {
+        nums[i] = v->cell[i]->num;
+        lval_del(v->cell[i]);
+    }
+    lcells_free(v->cell - v->off, v->cap);
+
+    v->cap    = v->count;
+    v->off    = 0;
+    v->packed = 1;
+    v->nums   = nums;
+}
+
+/** 
+ * Turn a packed list back into cells. This doesn't change the value, so v may be shared
+ */
+void lval_unpack(lval* v) {
+    if (!v->packed) { return; }
+
+    lval** cells = lcells_alloc(v->count);
+    for (int i = 0; i < v->count; ++i) {
+        cells[i] = lval_num(v->nums[i]);
+    }
+    free(v->nums - v->off);
+
+    v->cap    = lcells_capacity(v->count);
+    v->off    = 0;
+    v->packed = 0;
+    v->cell   = cells;
+}
+
+/** 
+ * Add lval to a s-expression
+ */
+lval* lval_add(lval* v, lval* x) {
+    /* Packed lists can only hold numbers, so give up packing first */
+    lval_unpack(v);
+    lval_uncode(v);
+
+    /* Make room at the back when it's full */
+    if (v->off + v->count == v->cap) {
+        lval** base = v->cell - v->off;
+
+        if (v->off >= v->count && v->off > 0) {
+            /* At least half of the array is free at the front, so slide the elements down */
+            memmove(base, v->cell, sizeof(lval*) * v->count);
+        } else {
+            /* Otherwise double the capacity, so appending stays amortized O(1) */
+            int cap = v->cap < 4 ? 4 : v->cap * 2;
+            base = lcells_grow(base, v->cap, cap);
+            memmove(base, base + v->off, sizeof(lval*) * v->count);
+            v->cap = cap;
+        }
+
+        v->off  = 0;
+        v->cell = base;
+    }
+
+    /* Increase the count of contained elements */
+    v->count++;
+
+    /* Finally, really add the new lval */
+    v->cell[v->count - 1] = x;
+
+    return v;
+}
+
+/** 
+ * Pop an element inside lval v with index i. v must not be shared
+ */
+lval* lval_pop(lval* v, int i) {
+    lval_uncode(v);
+
+    if (v->packed) {
+        lval* x = lval_num(v->nums[i]);
+
+        if (i == 0) {
+            v->nums++;
+            v->off++;
+        } else {
+            memmove(&v->nums[i], &v->nums[i + 1], sizeof(long) * (v->count - i - 1));
+        }
+
+        v->count--;
+        if (v->count == 0) {
+            v->nums -= v->off;
+            v->off = 0;
+        }
+
+        return x;
+    }
+
+    lval* x = v->cell[i];
+
+    if (i == 0) {
+        /* Popping the front only moves the front cursor */
+        v->cell++;
+        v->off++;
+    } else {
+        /* Shift the memory */
+        memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
+    }
+
+    /* Reduce the count of elements in the `v` */
+    v->count--;
+
+    /* Rewind the cursor once `v` is empty, so the whole array is reused */
+    if (v->count == 0) {
+        v->cell -= v->off;
+        v->off = 0;
+    }
+
+    return x;
+}
+
+/** 
+ * Get a new reference to the element of v with index i
+ */
+lval* lval_index(lval* v, int i) {
+    return v->packed ? lval_num(v->nums[i]) : lval_ref(v->cell[i]);
+}
+
+/** 
+ * Merge lval `y` into lval `x`
+ */
+lval* lval_join(lval* x, lval* y) {
+    /* `x` is modified, so make sure it's not shared */
+    x = lval_own(x);
+
+    /* One-by-one reference element in `y` and insert it to `x`, leaving `y` untouched */
+    for (int i = 0; i < y->count; ++i) {
+        x = lval_add(x, lval_index(y, i));
+    }
+
+    /* Delete `y`, or rather our reference to it */
+    lval_del(y);
+
+    return x;
+}
+
+lval* lval_take(lval* v, int i) {
+    /* There's no need to pop from v, since it's about to be deleted anyway */
+    lval* x = lval_index(v, i);
+    lval_del(v);
+
+    return x;
+}
+
+/** 
+ * Print the packed numbers of v as a list
+ */
+void lval_print_packed(lval* v, char open, char close) {
+    lout_char(open);
+
+    for (int i = 0; i < v->count; ++i) {
+        if (i) { lout_char(' '); }
+        lout_num(v->nums[i]);
+    }
+
+    lout_char(close);
+}
+
+/** 
+ * Print an lval. Lists are walked with a stack of their own rather than recursion, so deeply nested
+ * values can't overflow the C stack
+ */
+void lval_print(lval* v) {
+    /* The lists being printed, innermost last, along with how many of their elements are printed */
+    int    depth = 0;
+    int    slots = 0;
+    lval** lists = NULL;
+    int*   done  = NULL;
+
+    while (1) {
+        switch (v->type) {
+            case LVAL_NUM: lout_num(v->num);                      break;
+            case LVAL_ERR: lout_str("Error: "); lout_str(v->err); break;
+            case LVAL_SYM: lout_str(lsym_name(v->sym));           break;
+            case LVAL_FUN: lout_str("<function>");                break;
+
+            /* Packed numbers are printed directly, other lists are opened and their elements printed in turn */
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                if (v->packed) {
+                    lval_print_packed(v, v->type == LVAL_SEXPR ? '(' : '{', v->type == LVAL_SEXPR ? ')' : '}');
+                    break;
+                }
+
+                lout_char(v->type == LVAL_SEXPR ? '(' : '{');
+                if (depth == slots) {
+                    slots = slots ? slots * 2 : 16;
+                    lists = realloc(lists, sizeof(lval*) * slots);
+                    done  = realloc(done, sizeof(int) * slots);
+                }
+                lists[depth] = v;
+                done[depth]  = 0;
+                depth++;
+                break;
+        }
+
+        /* Close the lists which are done, then carry on with the next element of the innermost one */
+        while (depth && done[depth - 1] == lists[depth - 1]->count) {
+            depth--;
+            lout_char(lists[depth]->type == LVAL_SEXPR ? ')' : '}');
+        }
+        if (depth == 0) { break; }
+
+        /* If it's *NOT* the first element, put a space in front of it */
+        if (done[depth - 1]) { lout_char(' '); }
+        v = lists[depth - 1]->cell[done[depth - 1]++];
+    }
+
+    free(lists);
+    free(done);
+}
+
+/** 
+ * Print an lval, followed by a newline
+ */
+void lval_println(lval* v) {
+    lval_print(v);
+    lout_char('\n');
+}
+
+char* ltype_name(int t) {
+    switch(t) {
+        case LVAL_NUM: return "Number";
+        case LVAL_ERR: return "Error";
+        case LVAL_SYM: return "Symbol";
+        case LVAL_FUN: return "Function";
+        case LVAL_SEXPR: return "S-Expression";
+        case LVAL_QEXPR: return "Q-Expression";
+        default: return "Unknown";
+    }
+}
+
+/* lval */
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/* lenv */
+
+/** 
+ * Constructor for environment
+ */
+lenv* lenv_new(void) {
+    lenv* e  = malloc(sizeof(lenv));
+    e->count = 0;
+    e->slots = 0;
+    e->syms  = NULL;
+    e->vals  = NULL;
+
+    return e;
+}
+
+void lenv_del(lenv* e) {
+    for (int i = 0; i < e->slots; ++i) {
+        if (e->syms[i] != -1) { lval_del(e->vals[i]); }
+    }
+
+    free(e->syms);
+    free(e->vals);
+    free(e);
+}
+
+/** 
+ * Find the bucket of symbol `sym` in the environment e. If the symbol isn't bound, this is
+ * the empty bucket where it would be inserted
+ */
+int lenv_find(lenv* e, int sym) {
+    /* Symbol ids are dense integers, so a multiplicative hash spreads them well enough */
+    unsigned int mask = e->slots - 1;
+    unsigned int i    = ((unsigned int)sym * 2654435761u) & mask;
+    while (e->syms[i] != -1 && e->syms[i] != sym) { i = (i + 1) & mask; }
+
+    return i;
+}
+
+/** 
+ * Resize the environment e to have `slots` buckets, re-inserting all the bindings
+ */
+void lenv_rehash(lenv* e, int slots) {
+    int*   syms  = e->syms;
+    lval** vals  = e->vals;
+    int    count = e->slots;
+
+    e->slots = slots;
+    e->syms  = malloc(sizeof(int) * slots);
+    e->vals  = malloc(sizeof(lval*) * slots);
+    memset(e->syms, -1, sizeof(int) * slots);
+
+    for (int i = 0; i < count; ++i) {
+        if (syms[i] == -1) { continue; }
+        int j = lenv_find(e, syms[i]);
+        e->syms[j] = syms[i];
+        e->vals[j] = vals[i];
+    }
+
+    free(syms);
+    free(vals);
+}
+
+/** 
+ * Get the value bound to symbol id `sym` in the environment e
+ */
+lval* lenv_lookup(lenv* e, int sym) {
+    if (e->count) {
+        int i = lenv_find(e, sym);
+        if (e->syms[i] == sym) { return lval_ref(e->vals[i]); }
+    }
+
+    return lval_err("Unbound symbol '%s'", lsym_name(sym));
+}
+
+/** 
+ * Get a symbol k in the environment e
+ */
+lval* lenv_get(lenv* e, lval* k) {
+    return lenv_lookup(e, k->sym);
+}
+
+/** 
+ * Put a new variable named k with value v in environment e
+ */
+void lenv_put(lenv* e, lval* k, lval* v) {
+    /* Keep the table at most half full, so probe sequences stay short */
+    if (e->count * 2 >= e->slots) {
+        lenv_rehash(e, e->slots ? e->slots * 2 : 64);
+    }
+
+    int i = lenv_find(e, k->sym);
+
+    /* If the variable exists, delete the existing value, otherwise claim the empty bucket */
+    if (e->syms[i] == k->sym) {
+        lval_del(e->vals[i]);
+    } else {
+        e->syms[i] = k->sym;
+        e->count++;
+    }
+
+    e->vals[i] = lval_ref(v);
+}
+
+/* lenv */
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/* Built-ins */
 
 #define LASSERT(args, cond, fmt, ...) \
     if (!(cond)) { \
@@ -390,11 +1340,14 @@ void lenv_put(lenv* e, lval* k, lval* v) {
     }
 
 lval* lval_eval(lenv* e, lval* v);
+lcode* lval_code(lval* v);
+lval* lvm_run(lenv* e, lcode* c);
 
 /** 
  * Convert an lval to a list. In other word, make an s-expression to be q-expression
  */
 lval* builtin_list(lenv* e, lval* a) {
+    a = lval_own(a);
     a->type = LVAL_QEXPR;
     return a;
 }
@@ -411,11 +1364,12 @@ lval* builtin_head(lenv* e, lval* a) {
     /* Take the first argument */
     lval* v = lval_take(a, 0);
 
-    /* Delete all "tail" elements */
-    while (v->count > 1) { lval_del(lval_pop(v, 1)); }
+    /* Build the "head" in a new list, since v may be shared */
+    lval* x = lval_add(lval_qexpr(), lval_index(v, 0));
+    lval_del(v);
 
     /* Return the "head" */
-    return v;
+    return x;
 }
 
 /** 
@@ -427,8 +1381,8 @@ lval* builtin_tail(lenv* e, lval* a) {
     LASSERT(a, (a->cell[0]->type == LVAL_QEXPR), "Function 'tail' passed incorrect types");
     LASSERT(a, (a->cell[0]->count != 0), "Function 'tail' passed {}");
 
-    /* Take the first argument */
-    lval* v = lval_take(a, 0);
+    /* Take the first argument, making sure it's not shared before modifying it */
+    lval* v = lval_own(lval_take(a, 0));
 
     /* Delete the "head" */
     lval_del(lval_pop(v, 0));
@@ -444,9 +1398,12 @@ lval* builtin_eval(lenv* e, lval* a) {
     LASSERT(a, (a->count == 1), "Function 'eval' passed too many arguments");
     LASSERT(a, (a->cell[0]->type == LVAL_QEXPR), "Function 'eval' passed incorrect type");
 
+    /* Running the code of the q-expression doesn't modify it, so there's no need for a copy of it */
     lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    lval* r = lvm_run(e, lval_code(x));
+    lval_del(x);
+
+    return r;
 }
 
 lval* builtin_join(lenv* e, lval* a) {
@@ -465,47 +1422,303 @@ lval* builtin_join(lenv* e, lval* a) {
 }
 
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-    /* Ensure all arguments are numbers */
-    for (int i = 0; i < a->count; ++i) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval_del(a);
-            return lval_err("Cannot operate on non-number");
-        }
+/** 
+ * Add `x` to the sum `s` wrapping around, counting the wrap in `carry` like `lreduce` does. The exact
+ * sum is then `s` plus `carry` times 2^64, so it fits in a long exactly when `carry` ends up as 0
+ */
+static inline long lnums_add(long s, long x, long* carry) {
+    long r;
+    if (__builtin_add_overflow(s, x, &r)) { *carry += x < 0 ? -1 : 1; }
+    return r;
+}
+
+/** 
+ * Take the sum `s` with `carry` wraps, as made by `lnums_add`, away from `x`
+ */
+static inline long lnums_sub(long x, long s, long* carry) {
+    long r;
+    *carry = -*carry;
+    if (__builtin_sub_overflow(x, s, &r)) { *carry += s < 0 ? 1 : -1; }
+    return r;
+}
+
+/** 
+ * The magnitude of `x`, which fits even for the most negative number
+ */
+static inline unsigned long lnums_mag(long x) {
+    return x < 0 ? 0 - (unsigned long)x : (unsigned long)x;
+}
+
+/** 
+ * Multiply the magnitude `m` of a product by `x`, sticking at ULONG_MAX once it's too big. Magnitudes
+ * never shrink unless one is zero, so the product is too big exactly when its end magnitude is
+ */
+static inline unsigned long lnums_mag_mul(unsigned long m, unsigned long x) {
+    unsigned long r;
+    return __builtin_mul_overflow(m, x, &r) ? ULONG_MAX : r;
+}
+
+/** 
+ * The number with magnitude `m`, negative if `neg` is set, or an error if it doesn't fit in a long
+ */
+lval* lval_num_mag(unsigned long m, int neg) {
+    if (m > (neg ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX)) { return lval_err("Integer overflow"); }
+    return lval_num(neg ? (long)(0 - m) : (long)m);
+}
+
+/** 
+ * Arithmetic kernels, one tight loop per operator. Every operator gives an error when its exact result
+ * doesn't fit in a long, in these kernels and the packed ones alike, whatever order the numbers are in.
+ * Division is the exception, as it can't be reordered, so there each quotient on the way must fit
+ */
+lval* lop_add(long x, lval** cell, int count) {
+    long carry = 0;
+    for (int i = 0; i < count; ++i) { x = lnums_add(x, cell[i]->num, &carry); }
+    return carry ? lval_err("Integer overflow") : lval_num(x);
+}
+
+lval* lop_sub(long x, lval** cell, int count) {
+    /* Perform unary negation */
+    if (count == 0) { return lval_num_mag(lnums_mag(x), x > 0); }
+
+    long carry = 0;
+    long s = 0;
+    for (int i = 0; i < count; ++i) { s = lnums_add(s, cell[i]->num, &carry); }
+
+    x = lnums_sub(x, s, &carry);
+    return carry ? lval_err("Integer overflow") : lval_num(x);
+}
+
+lval* lop_mul(long x, lval** cell, int count) {
+    unsigned long m = lnums_mag(x);
+    int neg = x < 0;
+    for (int i = 0; i < count; ++i) {
+        m = lnums_mag_mul(m, lnums_mag(cell[i]->num));
+        neg ^= cell[i]->num < 0;
     }
+    return lval_num_mag(m, neg);
+}
 
-    /* We need to check the first element, so let's pop the first element */
-    lval* x = lval_pop(a, 0);
+lval* lop_div(long x, lval** cell, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (cell[i]->num == 0) { return lval_err("Division by zero"); }
+        if (cell[i]->num == -1 && x == LONG_MIN) { return lval_err("Integer overflow"); }
+        x /= cell[i]->num;
+    }
+    return lval_num(x);
+}
+
+/** 
+ * Kernel of every operator, indexed by LOP_*
+ */
+static const lkernel lop_kernels[LOP_COUNT] = { lop_add, lop_sub, lop_mul, lop_div };
+
+/** 
+ * Sum of packed numbers, one element at a time
+ */
+long lnums_sum_scalar(const long* nums, int count, long* carry) {
+    long s = 0;
+    for (int i = 0; i < count; ++i) { s = lnums_add(s, nums[i], carry); }
+
+    return s;
+}
+
+#ifdef LISPC_SIMD_X86
+/** 
+ * Add the lanes of `x` to those of `s`, wrapping around. Where a lane wraps its bit 0 is added to
+ * `wraps`, and also to `downs` when it wrapped down, which is when the number added was negative
+ */
+__attribute__((target("sse2")))
+static inline __m128i lnums_add_sse2(__m128i s, __m128i x, __m128i* wraps, __m128i* downs) {
+    __m128i r = _mm_add_epi64(s, x);
+    __m128i w = _mm_srli_epi64(_mm_andnot_si128(_mm_xor_si128(s, x), _mm_xor_si128(s, r)), 63);
+    *wraps = _mm_add_epi64(*wraps, w);
+    *downs = _mm_add_epi64(*downs, _mm_and_si128(w, _mm_srli_epi64(x, 63)));
+    return r;
+}
+
+/** 
+ * Sum of packed numbers, two 64-bit lanes at a time
+ */
+__attribute__((target("sse2")))
+long lnums_sum_sse2(const long* nums, int count, long* carry) {
+    __m128i s0 = _mm_setzero_si128();
+    __m128i s1 = _mm_setzero_si128();
+    __m128i wraps = _mm_setzero_si128();
+    __m128i downs = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        s0 = lnums_add_sse2(s0, _mm_loadu_si128((const __m128i*)(nums + i)), &wraps, &downs);
+        s1 = lnums_add_sse2(s1, _mm_loadu_si128((const __m128i*)(nums + i + 2)), &wraps, &downs);
+    }
+
+    long lanes[4], w[2], d[2];
+    _mm_storeu_si128((__m128i*)lanes, s0);
+    _mm_storeu_si128((__m128i*)(lanes + 2), s1);
+    _mm_storeu_si128((__m128i*)w, wraps);
+    _mm_storeu_si128((__m128i*)d, downs);
+
+    /* Every wrap up adds 1 to the carry and every wrap down takes 1 away */
+    long s = 0;
+    for (int k = 0; k < 4; ++k) { s = lnums_add(s, lanes[k], carry); }
+    for (int k = 0; k < 2; ++k) { *carry += w[k] - 2 * d[k]; }
+
+    return lnums_add(s, lnums_sum_scalar(nums + i, count - i, carry), carry);
+}
+
+/** 
+ * Like `lnums_add_sse2`, four lanes at a time
+ */
+__attribute__((target("avx2")))
+static inline __m256i lnums_add_avx2(__m256i s, __m256i x, __m256i* wraps, __m256i* downs) {
+    __m256i r = _mm256_add_epi64(s, x);
+    __m256i w = _mm256_srli_epi64(_mm256_andnot_si256(_mm256_xor_si256(s, x), _mm256_xor_si256(s, r)), 63);
+    *wraps = _mm256_add_epi64(*wraps, w);
+    *downs = _mm256_add_epi64(*downs, _mm256_and_si256(w, _mm256_srli_epi64(x, 63)));
+    return r;
+}
+
+/** 
+ * Sum of packed numbers, four 64-bit lanes at a time
+ */
+__attribute__((target("avx2")))
+long lnums_sum_avx2(const long* nums, int count, long* carry) {
+    __m256i s0 = _mm256_setzero_si256();
+    __m256i s1 = _mm256_setzero_si256();
+    __m256i wraps = _mm256_setzero_si256();
+    __m256i downs = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        s0 = lnums_add_avx2(s0, _mm256_loadu_si256((const __m256i*)(nums + i)), &wraps, &downs);
+        s1 = lnums_add_avx2(s1, _mm256_loadu_si256((const __m256i*)(nums + i + 4)), &wraps, &downs);
+    }
 
+    long lanes[8], w[4], d[4];
+    _mm256_storeu_si256((__m256i*)lanes, s0);
+    _mm256_storeu_si256((__m256i*)(lanes + 4), s1);
+    _mm256_storeu_si256((__m256i*)w, wraps);
+    _mm256_storeu_si256((__m256i*)d, downs);
+
+    long s = 0;
+    for (int k = 0; k < 8; ++k) { s = lnums_add(s, lanes[k], carry); }
+    for (int k = 0; k < 4; ++k) { *carry += w[k] - 2 * d[k]; }
+
+    return lnums_add(s, lnums_sum_scalar(nums + i, count - i, carry), carry);
+}
+#endif
+
+/** 
+ * Magnitude of the product of packed numbers, as made by `lnums_mag_mul`, flipping `neg` for each
+ * negative one. There's no 64-bit vector multiplication before AVX-512, so this keeps four independent
+ * accumulators instead
+ */
+unsigned long lnums_product(const long* nums, int count, int* neg) {
+    unsigned long p0 = 1, p1 = 1, p2 = 1, p3 = 1;
+    int n = 0;
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        p0 = lnums_mag_mul(p0, lnums_mag(nums[i]));
+        p1 = lnums_mag_mul(p1, lnums_mag(nums[i + 1]));
+        p2 = lnums_mag_mul(p2, lnums_mag(nums[i + 2]));
+        p3 = lnums_mag_mul(p3, lnums_mag(nums[i + 3]));
+        n ^= (nums[i] < 0) ^ (nums[i + 1] < 0) ^ (nums[i + 2] < 0) ^ (nums[i + 3] < 0);
+    }
+    for (; i < count; ++i) {
+        p0 = lnums_mag_mul(p0, lnums_mag(nums[i]));
+        n ^= nums[i] < 0;
+    }
+
+    *neg ^= n;
+    return lnums_mag_mul(lnums_mag_mul(p0, p1), lnums_mag_mul(p2, p3));
+}
+
+/** 
+ * The best sum kernel for this CPU, picked by `lnums_init`
+ */
+static lreduce lnums_sum = lnums_sum_scalar;
+
+/** 
+ * Pick the reduction kernels supported by this CPU
+ */
+void lnums_init(void) {
+#ifdef LISPC_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))      { lnums_sum = lnums_sum_avx2; }
+    else if (__builtin_cpu_supports("sse2")) { lnums_sum = lnums_sum_sse2; }
+#endif
+}
+
+/** 
+ * Packed kernels, the counterparts of the arithmetic kernels for packed lists
+ */
+lval* lpop_add(long x, const long* nums, int count) {
+    long carry = 0;
+    x = lnums_add(x, lnums_sum(nums, count, &carry), &carry);
+    return carry ? lval_err("Integer overflow") : lval_num(x);
+}
+
+lval* lpop_sub(long x, const long* nums, int count) {
     /* Perform unary negation */
-    if ((strcmp(op, "-") == 0) && a->count == 0) { x->num = -x->num; }
+    if (count == 0) { return lval_num_mag(lnums_mag(x), x > 0); }
+
+    long carry = 0;
+    x = lnums_sub(x, lnums_sum(nums, count, &carry), &carry);
+    return carry ? lval_err("Integer overflow") : lval_num(x);
+}
 
-    /* Process the remaining elements */
-    while (a->count > 0) {
+lval* lpop_mul(long x, const long* nums, int count) {
+    int neg = x < 0;
+    unsigned long m = lnums_product(nums, count, &neg);
+    return lval_num_mag(lnums_mag_mul(lnums_mag(x), m), neg);
+}
 
-        /* Pop the next element */
-        lval* y = lval_pop(a, 0);
+lval* lpop_div(long x, const long* nums, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (nums[i] == 0) { return lval_err("Division by zero"); }
+        if (nums[i] == -1 && x == LONG_MIN) { return lval_err("Integer overflow"); }
+        x /= nums[i];
+    }
+    return lval_num(x);
+}
 
-        /* Perform the operation */
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
+/** 
+ * Packed kernel of every operator, indexed by LOP_*
+ */
+static const lpkernel lpop_kernels[LOP_COUNT] = { lpop_add, lpop_sub, lpop_mul, lpop_div };
 
-                x = lval_err("Division by zero");
-                break;
-            }
+lval* builtin_op(lenv* e, lval* a, int op) {
+    /* A single q-expression is folded as if its elements were the arguments */
+    if (a->count == 1 && a->cell[0]->type == LVAL_QEXPR) {
+        a = lval_take(a, 0);
 
-            x->num /= y->num;
+        /* Sums and products of nothing are their identities, as they are for `sum` and `product` */
+        if (a->count == 0 && (op == LOP_ADD || op == LOP_MUL)) {
+            lval_del(a);
+            return lval_num(op == LOP_MUL);
+        }
+        LASSERT(a, (a->count != 0), "Cannot operate on {}");
+
+        if (a->packed) {
+            lval* x = lpop_kernels[op](a->nums[0], a->nums + 1, a->count - 1);
+            lval_del(a);
+            return x;
         }
+    }
 
-        /* Delete the already-processed_element */
-        lval_del(y);
+    /* Ensure all arguments are numbers */
+    for (int i = 0; i < a->count; ++i) {
+        if (a->cell[i]->type != LVAL_NUM) {
+            lval_del(a);
+            return lval_err("Cannot operate on non-number");
+        }
     }
 
+    /* The first element is the accumulator, the kernel folds the remaining ones into it */
+    lval* x = lop_kernels[op](a->cell[0]->num, a->cell + 1, a->count - 1);
+
     /* Now that the expression has been processed, delete it */
     lval_del(a);
 
@@ -513,19 +1726,52 @@ lval* builtin_op(lenv* e, lval* a, char* op) {
 }
 
 lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
+    return builtin_op(e, a, LOP_ADD);
 }
 
 lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-"); 
+    return builtin_op(e, a, LOP_SUB);
 }
 
 lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*"); 
+    return builtin_op(e, a, LOP_MUL);
 }
 
 lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/"); 
+    return builtin_op(e, a, LOP_DIV);
+}
+
+/** 
+ * Fold a q-expression of numbers with `op`, starting from `x`
+ */
+lval* builtin_reduce(lenv* e, lval* a, int op, long x, char* func) {
+    LASSERT(a, (a->count == 1), "Function '%s' passed too many arguments", func);
+    LASSERT(a, (a->cell[0]->type == LVAL_QEXPR), "Function '%s' passed incorrect type", func);
+
+    lval* v = lval_take(a, 0);
+
+    if (v->packed) {
+        lval* r = lpop_kernels[op](x, v->nums, v->count);
+        lval_del(v);
+        return r;
+    }
+
+    for (int i = 0; i < v->count; ++i) {
+        LASSERT(v, (v->cell[i]->type == LVAL_NUM), "Cannot operate on non-number");
+    }
+
+    lval* r = lop_kernels[op](x, v->cell, v->count);
+    lval_del(v);
+
+    return r;
+}
+
+lval* builtin_sum(lenv* e, lval* a) {
+    return builtin_reduce(e, a, LOP_ADD, 0, "sum");
+}
+
+lval* builtin_product(lenv* e, lval* a) {
+    return builtin_reduce(e, a, LOP_MUL, 1, "product");
 }
 
 lval* builtin_def(lenv* e, lval* a) {
@@ -533,93 +1779,282 @@ lval* builtin_def(lenv* e, lval* a) {
 
     /* Treat the first argument as a list of symbols */
     lval* syms = a->cell[0];
+    lval_unpack(syms);
 
     /* Ensure that it is */
     for (int i = 0; i < syms->count; ++i) {
         LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function 'def' cannot define non-symbol");
     }
 
-    /* Make sure that the count of symbols and values are correct */
-    LASSERT(a, (syms->count == a->count - 1), "Function 'def' cannot define incorrect number of values to symbol");
+    /* Make sure that the count of symbols and values are correct */
+    LASSERT(a, (syms->count == a->count - 1), "Function 'def' cannot define incorrect number of values to symbol");
+
+    /* Put the pair of symbol and value on the environment */
+    for (int i = 0; i < syms->count; ++i) {
+        lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    }
+
+    /* Now that we're done, delete the value */
+    lval_del(a);
+
+    /* Return empty sexpr because function definition doesn't need return meaningful value */
+    return lval_sexpr();
+}
+
+/** 
+ * Table of the standard builtins, terminated by an empty entry
+ */
+static const struct { char* name; lbuiltin func; } lbuiltins[] = {
+    /* Variable functions */
+    { "def",     builtin_def },
+
+    /* List functions */
+    { "list",    builtin_list },
+    { "head",    builtin_head },
+    { "tail",    builtin_tail },
+    { "eval",    builtin_eval },
+    { "join",    builtin_join },
+
+    /* Mathematical functions */
+    { "+",       builtin_add },
+    { "-",       builtin_sub },
+    { "*",       builtin_mul },
+    { "/",       builtin_div },
+    { "sum",     builtin_sum },
+    { "product", builtin_product },
+
+    { NULL,      NULL }
+};
+
+lval* builtin(lenv* e, lval* a, char* func) {
+    for (int i = 0; lbuiltins[i].name; ++i) {
+        if (strcmp(lbuiltins[i].name, func) == 0) { return lbuiltins[i].func(e, a); }
+    }
+
+    lval_del(a);
+    return lval_err("Unknown function");
+}
+
+/** 
+ * Add a builtin in an environment
+ */
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    /* Make lval key as a way refer the function */
+    lval* k = lval_sym(name);
+
+    /* Make lval value contains the function itself */
+    lval* v = lval_fun(func);
+
+    /* Put it to e */
+    lenv_put(e, k, v);
+
+    /* We're done with the copying, let's clean up */
+    lval_del(k);
+    lval_del(v);
+}
+
+/** 
+ * Add standard builtins
+ */
+void lenv_add_builtins(lenv* e) {
+    for (int i = 0; lbuiltins[i].name; ++i) {
+        lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+    }
+}
+
+/* Built-ins */
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/* Compilation */
+
+/** 
+ * Constructor for compiled code
+ */
+lcode* lcode_new(void) {
+    lcode* c        = malloc(sizeof(lcode));
+    c->count        = 0;
+    c->slots        = 0;
+    c->code         = NULL;
+    c->consts_count = 0;
+    c->consts_slots = 0;
+    c->consts       = NULL;
+    c->depth        = 0;
+    c->refs         = 1;
+
+    return c;
+}
+
+/** 
+ * Free the memory of compiled code, leaving its constants alone
+ */
+void lcode_free(lcode* c) {
+    free(c->consts);
+    free(c->code);
+    free(c);
+}
+
+/** 
+ * Destructor for compiled code. Only the last reference really deletes it
+ */
+void lcode_del(lcode* c) {
+    if (--c->refs > 0) { return; }
+
+    for (int i = 0; i < c->consts_count; ++i) {
+        lval_del(c->consts[i]);
+    }
+    lcode_free(c);
+}
+
+/** 
+ * Take another reference to c
+ */
+lcode* lcode_ref(lcode* c) {
+    c->refs++;
+    return c;
+}
+
+/** 
+ * Append an instruction with its operand to the compiled code
+ */
+void lcode_emit(lcode* c, int op, int arg) {
+    /* Grow the instruction array geometrically, so emitting stays cheap */
+    if (c->count + 2 > c->slots) {
+        c->slots = c->slots ? c->slots * 2 : 16;
+        c->code  = realloc(c->code, sizeof(int) * c->slots);
+    }
+
+    c->code[c->count++] = op;
+    c->code[c->count++] = arg;
+}
+
+/** 
+ * Store `v` as a constant of the compiled code, and return its index
+ */
+int lcode_const(lcode* c, lval* v) {
+    if (c->consts_count == c->consts_slots) {
+        c->consts_slots = c->consts_slots ? c->consts_slots * 2 : 8;
+        c->consts       = realloc(c->consts, sizeof(lval*) * c->consts_slots);
+    }
+
+    c->consts[c->consts_count] = lval_ref(v);
+
+    return c->consts_count++;
+}
+
+/** 
+ * Compile the list `v` as a call, given that `sp` values are already on the stack when it runs: evaluate all
+ * of its children, then call the result. Nested s-expressions are compiled the same way, kept on a stack of
+ * their own rather than recursion, so deeply nested code can't overflow the C stack
+ */
+void lcode_compile_list(lcode* c, lval* v, int sp) {
+    /* The lists being compiled, innermost last, with how many of their children are done and where they start */
+    int    depth = 0;
+    int    slots = 0;
+    lval** lists = NULL;
+    int*   done  = NULL;
+    int*   bases = NULL;
+
+    while (1) {
+        /* Open the list. The call leaves its result on the stack, even when there are no children */
+        if (sp + 1 > c->depth) { c->depth = sp + 1; }
+
+        if (depth == slots) {
+            slots = slots ? slots * 2 : 16;
+            lists = realloc(lists, sizeof(lval*) * slots);
+            done  = realloc(done, sizeof(int) * slots);
+            bases = realloc(bases, sizeof(int) * slots);
+        }
+        lists[depth] = v;
+        done[depth]  = 0;
+        bases[depth] = sp;
+        depth++;
+
+        /* Compile children of the innermost list until one of them is an s-expression, closing lists as they're done */
+        v = NULL;
+        while (depth && v == NULL) {
+            lval* l = lists[depth - 1];
+
+            if (done[depth - 1] == l->count) {
+                lcode_emit(c, LCODE_CALL, l->count);
+                depth--;
+                continue;
+            }
+
+            /* Every child leaves exactly one more value on the stack */
+            lval* x = l->cell[done[depth - 1]];
+            int   at = bases[depth - 1] + done[depth - 1];
+            done[depth - 1]++;
+            if (at + 1 > c->depth) { c->depth = at + 1; }
 
-    /* Put the pair of symbol and value on the environment */
-    for (int i = 0; i < syms->count; ++i) {
-        lenv_put(e, syms->cell[i], a->cell[i + 1]);
-    }
+            switch (x->type) {
+                /* Symbols are looked up in the environment at run time, by their id */
+                case LVAL_SYM: lcode_emit(c, LCODE_LOOKUP, x->sym); break;
 
-    /* Now that we're done, delete the value */
-    lval_del(a);
+                /* S-expressions are opened in turn */
+                case LVAL_SEXPR: v = x; sp = at; break;
 
-    /* Return empty sexpr because function definition doesn't need return meaningful value */
-    return lval_sexpr();
-}
+                /* Everything else evaluates to itself */
+                default: lcode_emit(c, LCODE_CONST, lcode_const(c, x)); break;
+            }
+        }
 
-lval* builtin(lenv* e, lval* a, char* func) {
-    if (strcmp("list", func) == 0) { return builtin_list(e, a); }
-    if (strcmp("head", func) == 0) { return builtin_head(e, a); }
-    if (strcmp("tail", func) == 0) { return builtin_tail(e, a); }
-    if (strcmp("join", func) == 0) { return builtin_join(e, a); }
-    if (strcmp("eval", func) == 0) { return builtin_eval(e, a); }
-    if (strstr("+-*/", func)) { return builtin_op(e, a, func); }
+        if (v == NULL) { break; }
+    }
 
-    lval_del(a);
-    return lval_err("Unknown function");
+    free(lists);
+    free(done);
+    free(bases);
 }
 
 /** 
- * Add a builtin in an environment
+ * Get the code of the list `v` run as a call, which is what evaluating it as an s-expression does. The code
+ * is compiled the first time and kept in `v` until `v` is modified or deleted. That doesn't change the
+ * value, so `v` may be shared
  */
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    /* Make lval key as a way refer the function */
-    lval* k = lval_sym(name);
-
-    /* Make lval value contains the function itself */
-    lval* v = lval_fun(func);
+lcode* lval_code(lval* v) {
+    if (v->code == NULL) {
+        lval_unpack(v);
 
-    /* Put it to e */
-    lenv_put(e, k, v);
+        v->code = lcode_new();
+        lcode_compile_list(v->code, v, 0);
+        lcode_emit(v->code, LCODE_RET, 0);
+    }
 
-    /* We're done with the copying, let's clean up */
-    lval_del(k);
-    lval_del(v);
+    return v->code;
 }
 
 /** 
- * Add standard builtins
+ * Check whether the call `v` is `eval` of a q-expression, which the virtual machine runs itself
  */
-void lenv_add_builtins(lenv* e) {
-    /* Variable functions */
-    lenv_add_builtin(e, "def", builtin_def);
+int lcode_is_eval(lval* v) {
+    return v->count == 2
+        && v->cell[0]->type == LVAL_FUN && v->cell[0]->fun == builtin_eval
+        && v->cell[1]->type == LVAL_QEXPR;
+}
 
-    /* List functions */
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
+/** 
+ * Get a reference to the code of the q-expression passed to `eval` in the call `v`, run as if it was an
+ * s-expression. `v` is consumed, but the code stays with the q-expression for the next time it's evaluated
+ */
+lcode* lcode_compile_eval(lval* v) {
+    lval*  x = lval_take(v, 1);
+    lcode* c = lcode_ref(lval_code(x));
+    lval_del(x);
 
-    /* Mathematical functions */
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
+    return c;
 }
 
-/* Built-ins */
+/* Compilation */
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 /* Evaluation */
 
 /**
- * Evaluate an s-expression
+ * Call an s-expression whose children have all been evaluated
  */
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-    /* Evaluate all children */
-    for (int i = 0; i < v->count; ++i) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-    }
-
+lval* lval_call(lenv* e, lval* v) {
     /* Check for errors in all children */
     for (int i = 0; i < v->count; ++i) {
         if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
@@ -647,26 +2082,126 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
     return result;
 }
 
+/** 
+ * Run compiled code against the environment `e`. The code is left as it is, so it can be run again.
+ *
+ * `eval` of a q-expression doesn't recurse: the code of the q-expression is run in a new frame, kept on
+ * the heap along with the values. A call in tail position replaces the current frame instead, so chains
+ * of such calls run in constant memory. Every frame holds a reference to its code while it runs
+ */
+lval* lvm_run(lenv* e, lcode* c) {
+    lcode_ref(c);
+
+    /* The stack of values, grown whenever a frame needs more room than there is */
+    int    slots = c->depth;
+    lval** stack = malloc(sizeof(lval*) * slots);
+    int    sp    = 0;
+    int    pc    = 0;
+
+    /* The stack of suspended frames */
+    int     frames_count = 0;
+    int     frames_slots = 0;
+    lframe* frames       = NULL;
+
+    /* Dispatch the instructions one by one */
+    while (1) {
+        int op  = c->code[pc++];
+        int arg = c->code[pc++];
+
+        switch (op) {
+            /* Push a reference to the constant */
+            case LCODE_CONST:
+                stack[sp++] = lval_ref(c->consts[arg]);
+                break;
+
+            /* Push the value bound to the symbol */
+            case LCODE_LOOKUP:
+                stack[sp++] = lenv_lookup(e, arg);
+                break;
+
+            /* Collect the topmost `arg` values into a new s-expression, and call it */
+            case LCODE_CALL: {
+                lval* v  = lval_sexpr();
+                v->count = arg;
+                v->cap   = lcells_capacity(arg);
+                v->cell  = lcells_alloc(arg);
+                if (arg) {
+                    memcpy(v->cell, &stack[sp - arg], sizeof(lval*) * arg);
+                }
+                sp -= arg;
+
+                /* Anything but `eval` of a q-expression is simply called */
+                if (!lcode_is_eval(v)) {
+                    stack[sp++] = lval_call(e, v);
+                    break;
+                }
+
+                lcode* next = lcode_compile_eval(v);
+                if (c->code[pc] == LCODE_RET) {
+                    /* The call is in tail position, so the current frame is not needed anymore */
+                    lcode_del(c);
+                } else {
+                    /* Otherwise, suspend the current frame until the call returns */
+                    if (frames_count == frames_slots) {
+                        frames_slots = frames_slots ? frames_slots * 2 : 16;
+                        frames       = realloc(frames, sizeof(lframe) * frames_slots);
+                    }
+                    frames[frames_count].c  = c;
+                    frames[frames_count].pc = pc;
+                    frames_count++;
+                }
+
+                /* Run the new code on top of the values already there */
+                c  = next;
+                pc = 0;
+                if (sp + c->depth > slots) {
+                    slots = (sp + c->depth) * 2;
+                    stack = realloc(stack, sizeof(lval*) * slots);
+                }
+                break;
+            }
+
+            /* The value on top of the stack is the result of the frame */
+            case LCODE_RET:
+                lcode_del(c);
+
+                /* Once the outermost frame returns, it's the final result */
+                if (frames_count == 0) {
+                    lval* x = stack[--sp];
+                    free(stack);
+                    free(frames);
+
+                    return x;
+                }
+
+                /* Otherwise, it's the result of the call the suspended frame was waiting for */
+                frames_count--;
+                c  = frames[frames_count].c;
+                pc = frames[frames_count].pc;
+                break;
+        }
+    }
+}
+
 /** 
  * Evaluate an `lval`
  */
 lval* lval_eval(lenv* e, lval* v) {
-    /* Check whether v is a symbol. If it is so, get the value from
-       its enclosing environment. We also need to delete v because
-       it's already evaluated */
+    /* Only symbols and s-expressions need work, other expressions won't be touched */
+    if (v->type != LVAL_SYM && v->type != LVAL_SEXPR) { return v; }
+
+    /* A symbol only needs looking up */
     if (v->type == LVAL_SYM) {
         lval* x = lenv_get(e, v);
         lval_del(v);
         return x;
     }
 
-    /* Check whether v is an s-expression. If it is so, eval it */
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
-    }
+    /* Run the code of v, compiled only the first time v is evaluated */
+    lval* x = lvm_run(e, lval_code(v));
+    lval_del(v);
 
-    /* Other expression won't be touched */
-    return v;
+    return x;
 }
 
 /* Evaluation */
@@ -686,49 +2221,211 @@ lval* lval_read_num(mpc_ast_t* t) {
     return errno != ERANGE ? lval_num(x) : lval_err("Invalid number");
 }
 
+/** 
+ * Kinds of AST node told apart by `lval_read`, and the mpc tag ids they are known by
+ */
+enum { LTAG_OTHER, LTAG_NUMBER, LTAG_SYMBOL, LTAG_SEXPR, LTAG_QEXPR, LTAG_ROOT, LTAG_CHAR, LTAG_REGEX, LTAG_COUNT };
+
+static const char* ltag_names[LTAG_COUNT] = { NULL, "number", "symbol", "sexpr", "qexpr", ">", "char", "regex" };
+static int ltag_ids[LTAG_COUNT];
+
+/** 
+ * The kind of the AST node `t`, from the first of its tags which is known. Tags are compared by id only
+ */
+int lread_tag(mpc_ast_t* t) {
+    for (int id = t->tag_id; id; id = mpc_tag_rest(id)) {
+        int head = mpc_tag_head(id);
+        for (int k = LTAG_OTHER + 1; k < LTAG_COUNT; ++k) {
+            if (ltag_ids[k] == head) { return k; }
+        }
+    }
+    return LTAG_OTHER;
+}
+
 /* Read and parse the AST */
 lval* lval_read(mpc_ast_t* t) {
-    /* If it's a Number and Symbol, return its counterpart representation */
-    if (strstr(t->tag, "number")) { return lval_read_num(t); }
-    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
-
-    /* If it's a root, or an s-expression, or an q-expression, then create a new empty list */
     lval* x = NULL;
-    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-    if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-    if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+
+    switch (lread_tag(t)) {
+        /* If it's a Number and Symbol, return its counterpart representation */
+        case LTAG_NUMBER: return lval_read_num(t);
+        case LTAG_SYMBOL: return lval_sym(t->contents);
+
+        /* If it's a root, or an s-expression, or an q-expression, then create a new empty list */
+        case LTAG_ROOT:
+        case LTAG_SEXPR:  x = lval_sexpr(); break;
+        case LTAG_QEXPR:  x = lval_qexpr(); break;
+    }
 
     /* Fill the emptly list created above with any valid expression contained within */
     for (int i = 0; i < t->children_num; ++i) {
 
-        /* Drop all the "meaningless" AST before further processing */
-        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-        if (strcmp(t->children[i]->tag, "regex") == 0)  { continue; }
+        /* Drop all the "meaningless" AST, the brackets and the regexes, before further processing */
+        int tag = lread_tag(t->children[i]);
+        if (tag == LTAG_CHAR || tag == LTAG_REGEX) { continue; }
 
         /* Do the real processing of children */
         x = lval_add(x, lval_read(t->children[i]));
     }
 
+    /* Long lists of numbers are kept packed */
+    lval_pack(x);
+
     return x;
 }
 
-/* Reading */
-////////////////////////////////////////////////////////////////////////////////////////////////////
+/** 
+ * Check whether c may appear in a symbol
+ */
+int lread_is_symbol(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c && strchr("_+-*/\\=<>!&", c));
+}
 
-int main(int argc, char** argv) {
-    /* Create parsers */
-    mpc_parser_t* Number    = mpc_new("number");
-    mpc_parser_t* Symbol    = mpc_new("symbol");
-    mpc_parser_t* Sexpr     = mpc_new("sexpr");
-    mpc_parser_t* Qexpr     = mpc_new("qexpr");
-    mpc_parser_t* Expr      = mpc_new("expr");
-    mpc_parser_t* Lispc     = mpc_new("lispc");
+/** 
+ * Skip the whitespace at the current position
+ */
+void lread_skip(lreader* r) {
+    while (*r->s && strchr(" \f\n\r\t\v", *r->s)) { r->s++; }
+}
 
-    /* Define the language */
-    mpca_lang(MPC_LANG_DEFAULT,
+/** 
+ * Record a syntax error at the current position, reported as `filename:row:col`
+ */
+void lread_error(lreader* r, char* expected) {
+    int row = 1, col = 1;
+    for (char* c = r->start; c < r->s; ++c) {
+        if (*c == '\n') { row++; col = 1; } else { col++; }
+    }
+
+    if (r->s < r->end && *r->s == '\0') {
+        r->err = lval_err("%s:%i:%i: expected %s at NUL character", r->filename, row, col, expected);
+    } else if (*r->s) {
+        r->err = lval_err("%s:%i:%i: expected %s at '%c'", r->filename, row, col, expected, *r->s);
+    } else {
+        r->err = lval_err("%s:%i:%i: expected %s at end of input", r->filename, row, col, expected);
+    }
+}
+
+/** 
+ * Read a number or a symbol. Returns NULL and sets `r->err` on syntax errors
+ */
+lval* lread_atom(lreader* r) {
+    char* s = r->s;
+    lval* v = NULL;
+
+    if ((*s >= '0' && *s <= '9') || (*s == '-' && s[1] >= '0' && s[1] <= '9')) {
+        /* Numbers are tried first, so `-` followed by digits is never a symbol */
+        errno = 0;
+        long x = strtol(s, &r->s, 10);
+        v = errno != ERANGE ? lval_num(x) : lval_err("Invalid number");
+    } else if (lread_is_symbol(*s)) {
+        while (lread_is_symbol(*r->s)) { r->s++; }
+        v = lval_sym_n(s, r->s - s);
+    } else {
+        lread_error(r, "number, symbol, s-expression or q-expression");
+        return NULL;
+    }
+
+    lread_skip(r);
+    return v;
+}
+
+/** 
+ * Open the list x, which is read until the `close` character
+ */
+void lread_open(lreader* r, lval* x, char close) {
+    if (r->depth == r->slots) {
+        r->slots  = r->slots ? r->slots * 2 : 16;
+        r->lists  = realloc(r->lists, sizeof(lval*) * r->slots);
+        r->closes = realloc(r->closes, r->slots);
+    }
+
+    r->lists[r->depth]  = x;
+    r->closes[r->depth] = close;
+    r->depth++;
+}
+
+/** 
+ * Read expressions into an s-expression until the end of input. Nested lists are kept on the stack of open
+ * lists rather than read recursively, so how deep they go is only limited by memory. Returns NULL and sets
+ * `r->err` on syntax errors
+ */
+lval* lread_root(lreader* r) {
+    lread_open(r, lval_sexpr(), '\0');
+
+    while (1) {
+        lval* x     = r->lists[r->depth - 1];
+        char  close = r->closes[r->depth - 1];
+
+        if (*r->s == close && (close || r->s == r->end)) {
+            /* Step over the closing character, along with the whitespace after it. The root is closed by the end of input,
+               and a NUL character before it is a syntax error like any other */
+            if (close) {
+                r->s++;
+                lread_skip(r);
+            }
+
+            /* Long lists of numbers are kept packed */
+            lval_pack(x);
+
+            /* The list is done, so it goes into the list around it */
+            r->depth--;
+            if (r->depth == 0) { return x; }
+            r->lists[r->depth - 1] = lval_add(r->lists[r->depth - 1], x);
+            continue;
+        }
+
+        if (r->s == r->end) {
+            lread_error(r, close == ')' ? "')'" : "'}'");
+            break;
+        }
+
+        if (*r->s == '(' || *r->s == '{') {
+            char open = *r->s;
+            r->s++;
+            lread_skip(r);
+            lread_open(r, open == '(' ? lval_sexpr() : lval_qexpr(), open == '(' ? ')' : '}');
+            continue;
+        }
+
+        lval* v = lread_atom(r);
+        if (v == NULL) { break; }
+        r->lists[r->depth - 1] = lval_add(x, v);
+    }
+
+    /* On a syntax error, all the lists still open go */
+    while (r->depth) {
+        lval_del(r->lists[--r->depth]);
+    }
+
+    return NULL;
+}
+
+/** 
+ * Read the source text `s` of `len` characters directly into an s-expression, without building an AST. `s[len]`
+ * must be NUL. Syntax errors are returned as an error lval
+ */
+lval* lval_read_str(char* filename, char* s, size_t len) {
+    lreader r = { filename, s, s + len, s, NULL, 0, 0, NULL, NULL };
+
+    lread_skip(&r);
+    lval* x = lread_root(&r);
+
+    free(r.lists);
+    free(r.closes);
+
+    return x ? x : r.err;
+}
+
+/** 
+ * Parsers of the mpc reader. They're only built when the mpc reader is selected
+ */
+static mpc_parser_t* lgrammar[6];
+
+/** 
+ * Source of the mpc grammar
+ */
+static const char lgrammar_source[] =
             "                                                       \
              number     : /-?[0-9]+/  ;                             \
              symbol     : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/  ;       \
@@ -736,42 +2433,366 @@ int main(int argc, char** argv) {
              qexpr      : '{' <expr>* '}'  ;                        \
              expr       : <number> | <symbol> | <sexpr> | <qexpr> ; \
              lispc      : /^/ <expr>* /$/  ;                        \
-            ",
-            Number, Symbol, Sexpr, Qexpr, Expr, Lispc);
+            ";
+
+/** 
+ * Version of the grammar cache header, which is followed by what `mpc_save` writes. The header also holds
+ * the hash of `lgrammar_source`, so a cache of another version or of another grammar is never loaded, and
+ * the checksum of what follows it, so neither is a cache that's been cut short or damaged
+ */
+#define LGRAMMAR_CACHE_VERSION 2
+
+/** 
+ * Checksum (FNV-1a) of the file `f` from the offset `start` to its end. `f` is left at `start`
+ */
+unsigned int lgrammar_checksum(FILE* f, long start) {
+    unsigned int h = 2166136261u;
+    int c;
+
+    fseek(f, start, SEEK_SET);
+    while ((c = fgetc(f)) != EOF) {
+        h = (h ^ (unsigned char)c) * 16777619u;
+    }
+    fseek(f, start, SEEK_SET);
+
+    return h;
+}
+
+/** 
+ * Build the mpc grammar, returning the root parser. With a `cache` file the grammar is loaded from it
+ * when it can be, and otherwise built as usual and saved to it for the next time
+ */
+mpc_parser_t* lgrammar_new(const char* cache) {
+    /* Look up the tags that `lval_read` knows */
+    for (int k = LTAG_OTHER + 1; k < LTAG_COUNT; ++k) { ltag_ids[k] = mpc_tag_id(ltag_names[k]); }
+
+    /* Create parsers */
+    mpc_parser_t* Number    = lgrammar[0] = mpc_new("number");
+    mpc_parser_t* Symbol    = lgrammar[1] = mpc_new("symbol");
+    mpc_parser_t* Sexpr     = lgrammar[2] = mpc_new("sexpr");
+    mpc_parser_t* Qexpr     = lgrammar[3] = mpc_new("qexpr");
+    mpc_parser_t* Expr      = lgrammar[4] = mpc_new("expr");
+    mpc_parser_t* Lispc     = lgrammar[5] = mpc_new("lispc");
+
+    unsigned int hash = lsym_hash((char*)lgrammar_source, sizeof(lgrammar_source) - 1);
+
+    /* Loading the saved grammar leaves the parsers alone if it fails. A cache with the wrong header isn't
+       loaded at all, and is rebuilt below */
+    FILE* f = cache ? fopen(cache, "rb") : NULL;
+    if (f) {
+        int version;
+        unsigned int saved, sum;
+        if (fscanf(f, "lispc grammar %d %x %x", &version, &saved, &sum) == 3 && fgetc(f) == '\n'
+            && version == LGRAMMAR_CACHE_VERSION && saved == hash && lgrammar_checksum(f, ftell(f)) == sum) {
+            mpc_err_t* err = mpc_load(f, 6, Number, Symbol, Sexpr, Qexpr, Expr, Lispc);
+            if (err == NULL) { fclose(f); return Lispc; }
+            mpc_err_delete(err);
+        }
+        fclose(f);
+    }
+
+    /* Define the language */
+    mpca_lang(MPC_LANG_DEFAULT, lgrammar_source, Number, Symbol, Sexpr, Qexpr, Expr, Lispc);
+
+    /* Save it for next time, overwriting any stale cache. A cache that can't be written is only reported */
+    f = cache ? fopen(cache, "w+b") : NULL;
+    if (f) {
+        /* The checksum is only known once the grammar is saved, so it's filled in afterwards. It's written
+           with a fixed width for that */
+        fprintf(f, "lispc grammar %d %08x %08x\n", LGRAMMAR_CACHE_VERSION, hash, 0u);
+        long start = ftell(f);
+        mpc_err_t* err = mpc_save(f, 6, Number, Symbol, Sexpr, Qexpr, Expr, Lispc);
+        if (err == NULL) {
+            unsigned int sum = lgrammar_checksum(f, start);
+            rewind(f);
+            fprintf(f, "lispc grammar %d %08x %08x\n", LGRAMMAR_CACHE_VERSION, hash, sum);
+        }
+        fclose(f);
+        if (err) {
+            mpc_err_print(err);
+            mpc_err_delete(err);
+            remove(cache);
+        }
+    }
+
+    return Lispc;
+}
+
+/** 
+ * Clean up the mpc grammar
+ */
+void lgrammar_del(void) {
+    mpc_cleanup(6, lgrammar[0], lgrammar[1], lgrammar[2], lgrammar[3], lgrammar[4], lgrammar[5]);
+}
+
+/* Reading */
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/* Loading */
+
+/** 
+ * Read the whole source file `filename` into an s-expression of its expressions, with the direct reader or with
+ * `grammar`. mpc keeps the state of the parse in `ctx` and the AST in `arena`. The file `-` is the standard input.
+ * Errors are returned as an error lval
+ */
+lval* lload_read(char* filename, mpc_parser_t* grammar, mpc_context_t* ctx, mpc_arena_t* arena) {
+    int   std = strcmp(filename, "-") == 0;
+    FILE* f   = std ? stdin : fopen(filename, "rb");
+    if (f == NULL) { return lval_err("Could not open file '%s'", filename); }
+    if (std) { filename = "<stdin>"; }
+
+    /* Read the file in, growing the buffer as it fills */
+    size_t len = 0, cap = 4096;
+    char*  s   = malloc(cap);
+    size_t n;
+    while ((n = fread(s + len, 1, cap - len - 1, f)) > 0) {
+        len += n;
+        if (len + 1 == cap) {
+            cap *= 2;
+            s = realloc(s, cap);
+        }
+    }
+    s[len] = '\0';
+    if (!std) { fclose(f); }
+
+    lval* x;
+    if (grammar == NULL) {
+        x = lval_read_str(filename, s, len);
+    } else {
+        mpc_result_t res;
+        if (mpc_parse_context(ctx, filename, s, len, grammar, arena, &res)) {
+            x = lval_read(res.output);
+            mpc_arena_clear(arena);
+        } else {
+            /* Keep the message of the parse error, without its newline */
+            char* msg = mpc_err_string(res.error);
+            msg[strcspn(msg, "\n")] = '\0';
+            x = lval_err("%s", msg);
+            free(msg);
+            mpc_err_delete(res.error);
+        }
+    }
 
-    puts("Lispc version 0.0.7");
-    puts("Press Ctrl+C to exit\n");
+    free(s);
+    return x;
+}
+
+/** 
+ * Body of a thread of the loader, which takes files to read until there's none left
+ */
+void* lload_worker(void* arg) {
+    lworker* w = arg;
+    lloader* l = w->loader;
+
+    /* Values are carved from the thread's own pool, and mpc gets a context and an arena of its own */
+    lvals_local = &w->pool;
+    mpc_context_t* ctx   = l->grammar ? mpc_context_new() : NULL;
+    mpc_arena_t*   arena = l->grammar ? mpc_arena_new() : NULL;
+
+    while (1) {
+        pthread_mutex_lock(&l->lock);
+        int k = l->next++;
+        pthread_mutex_unlock(&l->lock);
+
+        if (k >= l->count) { break; }
+        l->vals[k] = lload_read(l->files[k], l->grammar, ctx, arena);
+    }
+
+    if (l->grammar) {
+        mpc_arena_delete(arena);
+        mpc_context_delete(ctx);
+    }
+
+    /* The pending stack of `lval_del` is the only other memory of the thread */
+    free(ldel_pending);
+    ldel_pending       = NULL;
+    ldel_pending_slots = 0;
+
+    lvals_local = &lvals_pool;
+    return NULL;
+}
+
+/** 
+ * Load the `count` source files `files` into the environment. The files are read in parallel, on as many threads
+ * as there are cores (or LISPC_LOAD_THREADS), and then evaluated one after the other in the order given. The
+ * result of every expression is printed if `print` is set, and otherwise only the errors are. Returns 0 if any
+ * file couldn't be read or any expression evaluated to an error, and 1 otherwise
+ */
+int lload(lenv* e, mpc_parser_t* grammar, int count, char** files, int print) {
+    if (count == 0) { return 1; }
+
+    lloader l;
+    l.count   = count;
+    l.files   = files;
+    l.vals    = malloc(sizeof(lval*) * count);
+    l.grammar = grammar;
+    l.next    = 0;
+    pthread_mutex_init(&l.lock, NULL);
+
+    /* There's no point in having more threads than files */
+    char* env = getenv("LISPC_LOAD_THREADS");
+    long threads = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > count) { threads = count; }
+    if (threads < 1) { threads = 1; }
+
+    lworker* workers = calloc(threads, sizeof(lworker));
+    int started = 0;
+    for (int i = 0; i < threads; ++i) {
+        workers[i].loader = &l;
+        if (pthread_create(&workers[i].thread, NULL, lload_worker, &workers[i]) != 0) { break; }
+        started++;
+    }
+
+    /* If no thread could be started, the files are read right here */
+    if (started == 0) {
+        lload_worker(&workers[0]);
+    }
+
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    /* Everything read is now owned by the interpreter's pool */
+    for (int i = 0; i < threads; ++i) {
+        lpool_merge(&workers[i].pool);
+    }
+    free(workers);
+    pthread_mutex_destroy(&l.lock);
+
+    /* Evaluate the expressions of every file in turn */
+    int ok = 1;
+    for (int k = 0; k < count; ++k) {
+        lval* x = l.vals[k];
+
+        if (x->type == LVAL_ERR) {
+            lval_println(x);
+            lval_del(x);
+            ok = 0;
+            continue;
+        }
+
+        while (x->count) {
+            lval* r = lval_eval(e, lval_pop(x, 0));
+            if (r->type == LVAL_ERR) { ok = 0; }
+            if (print || r->type == LVAL_ERR) { lval_println(r); }
+            lval_del(r);
+        }
+        lval_del(x);
+    }
+
+    free(l.vals);
+    return ok;
+}
+
+/* Loading */
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+    /* The direct reader is used, unless the mpc one is asked for. A grammar cache implies it */
+    int mpc = 0;
+    char* cache = NULL;
+
+    /* In batch mode the files, or else the standard input, are run without readline and the REPL */
+    int batch = 0;
+
+    /* Any other argument is a source file, loaded before the REPL starts */
+    int files_count = 0;
+    char** files = malloc(sizeof(char*) * (argc + 1));
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--mpc") == 0) { mpc = 1; }
+        else if (strcmp(argv[i], "--batch") == 0) { batch = 1; }
+        else if (strcmp(argv[i], "--grammar-cache") == 0 && i + 1 < argc) { mpc = 1; cache = argv[++i]; }
+        else if (strncmp(argv[i], "--", 2) != 0) { files[files_count++] = argv[i]; }
+        else {
+            /* An option that isn't known, or is missing its argument, is a mistake rather than something to skip */
+            fprintf(stderr, "lispc: bad option '%s'\n", argv[i]);
+            fprintf(stderr, "usage: %s [--mpc] [--grammar-cache FILE] [--batch] [FILE...]\n", argv[0]);
+            free(files);
+            return 2;
+        }
+    }
+    mpc_parser_t* Lispc = mpc ? lgrammar_new(cache) : NULL;
+    mpc_arena_t* arena = mpc ? mpc_arena_new() : NULL;
+
+    if (batch && files_count == 0) { files[files_count++] = "-"; }
+
+    if (!batch) {
+        puts("Lispc version 0.0.7");
+        puts("Press Ctrl+C to exit\n");
+    }
 
-    /* Prepare the environment */
+    /* Prepare the shared values, then the environment */
+    lval_small_init();
+    lnums_init();
     lenv* e = lenv_new();
     lenv_add_builtins(e);
 
+    /* Load the source files given. In batch mode that's all there is to do, so every result is printed, and
+       any error makes the exit status nonzero */
+    int ok = lload(e, Lispc, files_count, files, batch);
+    free(files);
+
     /* Do the main loop for REPL */
-    while (1) {
+    while (!batch) {
+        /* Everything printed so far has to be out before the prompt */
+        lout_flush();
+
         char* input = readline("lispc > ");
+
+        /* End of input (Ctrl+D) ends the session */
+        if (input == NULL) {
+            putchar('\n');
+            break;
+        }
+
         add_history(input);
 
         /* Process the input */
-        mpc_result_t res;
-        if (mpc_parse("<stdin>", input, Lispc, &res)) {
+        if (Lispc == NULL) {
 
-            /* Read and parse the result */
-            lval* x = lval_eval(e, lval_read(res.output));
+            /* Read the input directly. A syntax error is printed like any other error */
+            lval* x = lval_read_str("<stdin>", input, strlen(input));
+            if (x->type != LVAL_ERR) { x = lval_eval(e, x); }
             lval_println(x);
             lval_del(x);
-
-            mpc_ast_delete(res.output);
         }
         else {
-            mpc_err_print(res.error);
-            mpc_err_delete(res.error);
+            mpc_result_t res;
+            if (mpc_parse_arena("<stdin>", input, Lispc, arena, &res)) {
+
+                /* Read the result. The AST is done with then, so all of it goes at once */
+                lval* x = lval_read(res.output);
+                mpc_arena_clear(arena);
+
+                x = lval_eval(e, x);
+                lval_println(x);
+                lval_del(x);
+            }
+            else {
+                mpc_err_print(res.error);
+                mpc_err_delete(res.error);
+            }
         }
 
         free(input);
     }
 
+    lout_flush();
+
+    /* Clean up the environment, then all the memory it was using */
+    lenv_del(e);
+    lpool_clear();
+
+    /* Report the allocations if asked to */
+    if (getenv("LISPC_ALLOC_REPORT")) { lpool_report(stderr); }
+
     /* Clean up the parsers */
-    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispc);
+    if (Lispc) {
+        mpc_arena_delete(arena);
+        lgrammar_del();
+    }
 
-    return 0;
+    return batch && !ok ? 1 : 0;
 }